@@ -842,24 +842,16 @@ int main()
 
 	for(;;)
 	{
-		#ifndef __AVR
-		// Be a little nicer when not on the avr hardware since the
-		// speaker interrupt really is on another thread, this thread
-		// doesn't need to wake up every time the interrupt goes off.
-		_delay_us(1000);
-		#endif
 		// sleep while waiting for an interrupt
 		// see avr/sleep.h by disabling the interrupt the check is
 		// atomic
-		/*
 		set_sleep_mode(SLEEP_MODE_IDLE);
 		cli();
-		*/
 
 		// If another time slice has elapsed
 		if(tickFlag)
 		{
-			//sei();
+			sei();
 
 			// Reset this flag so this code isn't run again until
 			// another slice has elapsed.
@@ -869,7 +861,6 @@ int main()
 			// this pass).
 			task_dispatch();
 		}
-		/*
 		else
 		{
 			sleep_enable();
@@ -877,7 +868,6 @@ int main()
 			sleep_cpu();
 			sleep_disable();
 		}
-		*/
 	}
 
 	return -1;
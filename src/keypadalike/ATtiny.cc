@@ -21,101 +21,622 @@ hardware buttons and LEDs.
 */
 
 #include "ATtiny.h"
-#include <sched.h>
 #include <string.h>
-
-ATtiny g_ATtiny;
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <link.h>
+#include "ChipState.h"
 
 ATtiny::ATtiny() :
-	ThreadsRunning(0),
-	MainThread(NULL)
+	TimerEvents(&VirtualTime, &IrqControl),
+	IrqControl(this, &TimerEvents),
+	Chip(this, &VirtualTime, &TimerEvents, &IrqControl),
+	MainWaiting(0),
+	BatonWanted(0),
+	Progress(0),
+	Spinning(false),
+	SpinProgress(0),
+	IntHandled(0),
+	HandledTime(0),
+	SleepFrom(0),
+	MainThread(NULL),
+	Context(NULL),
+	Image(NULL),
+	ImageSize(0),
+	Main(NULL),
+	Running(false),
+	Stopping(false),
+	MainAtomic(0),
+	MainCall(NULL)
 {
+	memset(&Wakes, 0, sizeof(Wakes));
+	memset(&Sleeps, 0, sizeof(Sleeps));
+	memset(Data, 0, sizeof(Data));
+	VirtualTime.SetScheduler(&TimerEvents);
 }
 
-void ATtiny::SetThreadAffinity()
+ATtiny::~ATtiny()
 {
-	// Schedule this thread only on the first CPU, any will work, but
-	// the first will always be there to select.
-	cpu_set_t mask;
-	memset(&mask, 0, sizeof(mask));
-	CPU_SET(0, &mask);
-	// 0 is the caller's thread id
-	sched_setaffinity(0, sizeof(mask), &mask);
+	// The timers are deleted with Chip, stop running them first.
+	TimerEvents.Stop();
+	// A program still running (not stopped) is left loaded.
+	if(Image && (!Running || Stopping))
+		dlclose(Image);
 }
 
-void ATtiny::MainStart()
+// Copy the file at path to a new temporary file, returns the copy's name
+// in copy, or false on error.
+static bool CopyFile(const char *path, char *copy, size_t size)
+{
+	const char *dir=getenv("TMPDIR");
+	snprintf(copy, size, "%s/keypadalike-XXXXXX", dir ? dir : "/tmp");
+	int out=mkstemp(copy);
+	if(out==-1)
+	{
+		perror(copy);
+		return false;
+	}
+	int in=open(path, O_RDONLY);
+	if(in==-1)
+	{
+		perror(path);
+		close(out);
+		unlink(copy);
+		return false;
+	}
+	char buf[65536];
+	ssize_t len;
+	bool ok=true;
+	while(ok && (len=read(in, buf, sizeof(buf))) > 0)
+		ok=write(out, buf, len)==len;
+	if(len < 0 || !ok)
+	{
+		perror(copy);
+		ok=false;
+	}
+	close(in);
+	if(close(out) || !ok)
+	{
+		unlink(copy);
+		return false;
+	}
+	return true;
+}
+
+bool ATtiny::Load(const char *path)
+{
+	char copy[4096];
+	if(!CopyFile(path, copy, sizeof(copy)))
+		return false;
+	// RTLD_LOCAL keeps the program's symbols from resolving another
+	// chip's program, the copy isn't needed once it is loaded.
+	void *image=dlopen(copy, RTLD_NOW | RTLD_LOCAL);
+	if(image && !FindData(copy))
+		fprintf(stderr, "%s program data not found, SaveState "
+			"won't work\n", path);
+	unlink(copy);
+	if(!image)
+	{
+		fprintf(stderr, "%s\n", dlerror());
+		return false;
+	}
+	typedef RegContext* (*ContextFunc)();
+	ContextFunc context=(ContextFunc)dlsym(image, "avr_context");
+	int (*main)()=(int (*)())dlsym(image, "avr_main");
+	if(!context || !main)
+	{
+		fprintf(stderr, "%s isn't a program, avr_context or avr_main "
+			"missing\n", path);
+		dlclose(image);
+		return false;
+	}
+	Attach(context(), image, main);
+	Image=image;
+	return true;
+}
+
+bool ATtiny::FindData(const char *path)
+{
+	int fd=open(path, O_RDONLY);
+	if(fd==-1)
+		return false;
+	ElfW(Ehdr) ehdr;
+	bool ok=pread(fd, &ehdr, sizeof(ehdr), 0)==sizeof(ehdr) &&
+		!memcmp(ehdr.e_ident, ELFMAG, SELFMAG) &&
+		ehdr.e_shentsize==sizeof(ElfW(Shdr)) &&
+		ehdr.e_phentsize==sizeof(ElfW(Phdr)) &&
+		ehdr.e_shstrndx < ehdr.e_shnum;
+	std::vector<ElfW(Shdr)> sections(ok ? ehdr.e_shnum : 0);
+	std::vector<ElfW(Phdr)> segments(ok ? ehdr.e_phnum : 0);
+	size_t size=sections.size()*sizeof(ElfW(Shdr));
+	ok=ok && pread(fd, &sections[0], size, ehdr.e_shoff)==(ssize_t)size;
+	size=segments.size()*sizeof(ElfW(Phdr));
+	ok=ok && pread(fd, &segments[0], size, ehdr.e_phoff)==(ssize_t)size;
+	std::vector<char> names;
+	if(ok)
+	{
+		const ElfW(Shdr) &strtab=sections[ehdr.e_shstrndx];
+		names.resize(strtab.sh_size+1);
+		ok=pread(fd, &names[0], strtab.sh_size, strtab.sh_offset)==
+			(ssize_t)strtab.sh_size;
+	}
+	close(fd);
+	if(!ok)
+		return false;
+
+	const char *wanted[DataSections]={".data", ".bss"};
+	memset(Data, 0, sizeof(Data));
+	for(size_t i=0; i<sections.size(); ++i)
+	{
+		if(sections[i].sh_name >= names.size())
+			continue;
+		for(int j=0; j<DataSections; ++j)
+		{
+			if(strcmp(&names[sections[i].sh_name], wanted[j]))
+				continue;
+			Data[j].Offset=sections[i].sh_addr;
+			Data[j].Size=sections[i].sh_size;
+		}
+	}
+	ImageSize=0;
+	for(size_t i=0; i<segments.size(); ++i)
+	{
+		if(segments[i].p_type==PT_LOAD)
+			ImageSize=std::max<uintptr_t>(ImageSize,
+				segments[i].p_vaddr+segments[i].p_memsz);
+	}
+	return ImageSize;
+}
+
+bool ATtiny::ImageBase(uintptr_t *base)
+{
+	struct link_map *map;
+	if(!Image || !ImageSize || dlinfo(Image, RTLD_DI_LINKMAP, &map))
+	{
+		fprintf(stderr, "ATtiny program wasn't loaded with Load, "
+			"it has no state to save or restore\n");
+		return false;
+	}
+	*base=map->l_addr;
+	return true;
+}
+
+bool ATtiny::ProgramHash(uint64_t *hash)
+{
+	struct link_map *map;
+	if(!Image || !ImageSize || dlinfo(Image, RTLD_DI_LINKMAP, &map))
+		return false;
+	// FNV-1a
+	uint64_t h=14695981039346656037ull;
+	for(int i=0; i<DataSections; ++i)
+	{
+		const uint8_t *data=(const uint8_t*)(map->l_addr+
+			Data[i].Offset);
+		for(size_t j=0; j<Data[i].Size; ++j)
+			h=(h ^ data[j])*1099511628211ull;
+	}
+	*hash=h;
+	return true;
+}
+
+void ATtiny::Attach(RegContext *context, void *image, int (*main)())
+{
+	Context=context;
+	Context->File=Chip.File();
+	Context->Charge=VirtualTime.IsEnabled();
+	Context->Chip=this;
+	IrqControl.SetImage(image);
+	Main=main;
+}
+
+int ATtiny::Run()
+{
+	RegisterMainThread();
+	Running=true;
+	int ret=-1;
+	try
+	{
+		MainStart();
+		ret=Main();
+		MainStop();
+	}
+	catch(const Stopped&)
+	{
+		// the program's state is abandoned along with the chip
+	}
+	Running=false;
+	return ret;
+}
+
+void ATtiny::Stop()
+{
+	QMutexLocker locker(&Mutex);
+	Stopping=true;
+	// a sleeping or waiting thread checks it when woken
+	locked_Wake(&MainCond, MainWaiting);
+	locked_Wake(&MainBaton.Cond, MainBaton.Waiting);
+	locked_Wake(&HandlerBaton.Cond, HandlerBaton.Waiting);
+}
+
+void ATtiny::RunMainCall()
 {
+	if(MainThread!=QThread::currentThread() || std::uncaught_exception())
+		return;
+	if(TimerScheduler::Client *client=MainCall.exchange(NULL))
+		TimerEvents.RunExclusive(client);
+}
+
+void ATtiny::EnableVirtualTime()
+{
+	VirtualTime.Enable();
+	// the inline register operations charge their cycles
+	if(Context)
+		Context->Charge=true;
+}
+
+enum
+{
+	// "KPS" and the format version
+	StateMagic=0x4b505301
+};
+
+bool ATtiny::SaveState(std::vector<uint8_t> *out)
+{
+	uintptr_t base;
+	if(!ImageBase(&base))
+		return false;
+	ChipState state;
+	state.Put((uint32_t)StateMagic);
+	state.Put((uint64_t)base);
+	state.Put((uint64_t)ImageSize);
+	for(int i=0; i<DataSections; ++i)
+	{
+		state.Put((uint64_t)Data[i].Size);
+		state.Put((const void*)(base+Data[i].Offset), Data[i].Size);
+	}
+	{
+		QMutexLocker locker(&Mutex);
+		Chip.SaveState(&state, TimerEvents.Now());
+	}
+	out->swap(state.Data);
+	return true;
+}
+
+bool ATtiny::RestoreState(const std::vector<uint8_t> &saved)
+{
+	uintptr_t base;
+	if(!ImageBase(&base))
+		return false;
+	ChipState state(saved);
+	bool ok=state.Get<uint32_t>()==StateMagic;
+	uintptr_t old_base=state.Get<uint64_t>();
+	ok=ok && state.Get<uint64_t>()==ImageSize;
+	std::vector<uint8_t> data[DataSections];
+	for(int i=0; ok && i<DataSections; ++i)
+	{
+		ok=state.Get<uint64_t>()==Data[i].Size;
+		data[i].resize(Data[i].Size);
+		if(ok && Data[i].Size)
+			state.Get(&data[i][0], Data[i].Size);
+	}
+	if(!ok || state.Failed())
+	{
+		fprintf(stderr, "ATtiny::RestoreState the state isn't from "
+			"this program\n");
+		return false;
+	}
+
+	/* Pointers the program keeps to its own code and data were saved
+	 * with the old load address, anything aligned that points into
+	 * the old image is taken to be one.
+	 */
+	uintptr_t delta=base-old_base;
+	for(int i=0; delta && i<DataSections; ++i)
+	{
+		uintptr_t start=base+Data[i].Offset;
+		size_t skip=-start & (sizeof(uintptr_t)-1);
+		for(size_t j=skip; j+sizeof(uintptr_t)<=data[i].size();
+			j+=sizeof(uintptr_t))
+		{
+			uintptr_t v;
+			memcpy(&v, &data[i][j], sizeof(v));
+			if(v-old_base >= ImageSize)
+				continue;
+			v+=delta;
+			memcpy(&data[i][j], &v, sizeof(v));
+		}
+	}
+	// RegContext is in .bss and belongs to this chip
+	RegContext context=*Context;
+	for(int i=0; i<DataSections; ++i)
+	{
+		if(Data[i].Size)
+			memcpy((void*)(base+Data[i].Offset), &data[i][0],
+				Data[i].Size);
+	}
+	*Context=context;
+
 	QMutexLocker locker(&Mutex);
-	// The main thread can run if no other thread is running or if
-	// interrupts are enabled.  As opposed to interrupt threads it can
-	// still run even when interrupts are disabled.
-	while(ThreadsRunning && !locked_IrqEnabled())
-		Cond.wait(&Mutex);
+	Chip.RestoreState(&state, TimerEvents.Now());
+	if(state.Failed() || !state.AtEnd())
+	{
+		fprintf(stderr, "ATtiny::RestoreState the chip state is "
+			"corrupt\n");
+		return false;
+	}
+	return true;
+}
 
-	++ThreadsRunning;
+void ATtiny::RegisterMainThread()
+{
+	MainThread=QThread::currentThread();
+	// stalls are measured in the main thread's CPU time
+	clockid_t clock;
+	if(!pthread_getcpuclockid(pthread_self(), &clock))
+		TimerEvents.SetStallClock(clock);
+}
+
+void ATtiny::AfterFork()
+{
+	RegisterMainThread();
+	TimerEvents.AfterFork();
+}
+
+void ATtiny::MainStart()
+{
+	QMutexLocker locker(&Mutex);
+	// The main thread runs once no interrupt handler has the baton.
+	locked_MainWaitRun();
+	Baton.push_back(MainThread);
 }
 
 void ATtiny::MainStop()
 {
 	QMutexLocker locker(&Mutex);
-	--ThreadsRunning;
-	Cond.wakeAll();
+	locked_GiveBaton();
 }
 
 void ATtiny::MainSleep()
 {
+	uint64_t start=TimerEvents.Now();
+	{
+		QMutexLocker locker(&Mutex);
+		if(!locked_IrqEnabled())
+		{
+			// the hardware wouldn't ever wake up
+			fprintf(stderr, "ATtiny::MainSleep with interrupts "
+				"disabled, ignored\n");
+			return;
+		}
+		Chip.Tone().Sleeping();
+	}
+	// With virtual time nothing else moves the time forward.
+	if(VirtualTime.IsEnabled())
+	{
+		do
+		{
+			StopPoint();
+			QMutexLocker locker(&Mutex);
+			if(IntHandled!=SleepFrom)
+			{
+				locked_Woke(start);
+				return;
+			}
+		} while(VirtualTime.Idle());
+	}
+
 	QMutexLocker locker(&Mutex);
 	// like MainStop let any other thread run
-	--ThreadsRunning;
-	Cond.wakeAll();
+	locked_GiveBaton();
 
-	// wait for an interrupt to broadcast
-	Cond.wait(&Mutex);
+	// wait for an interrupt handler to return
+	int wakes=0;
+	while(IntHandled==SleepFrom && !Stopping)
+	{
+		locked_Wait(&MainCond, &MainWaiting);
+		++wakes;
+	}
+	ThrowIfStopped();
+	if(wakes)
+		Wakes.Spurious+=wakes-1;
+	locked_Woke(start);
 
 	// like MainStart wait to run
-	while(ThreadsRunning && !locked_IrqEnabled())
-		Cond.wait(&Mutex);
-
-	++ThreadsRunning;
+	locked_MainWaitRun();
+	Baton.push_back(MainThread);
 }
 
-void ATtiny::IntStart()
+bool ATtiny::IntTryStart()
 {
 	QMutexLocker locker(&Mutex);
-	// An interrupt thread can run if interrupts are enabled, but it
-	// does disable interrupts to prevent any new threads from running.
-	while(!locked_IrqEnabled())
-		Cond.wait(&Mutex);
-
-	// Would not get here unless interrupts were disabled, therefore
-	// they can be disabled.
-	locked_EnableInterrupts(false);
-	++ThreadsRunning;
+	if(!locked_IrqEnabled())
+		return false;
+	// Main reads SREG without the lock and keeps running until it
+	// hands over the baton, clearing I before then could be saved and
+	// restored by an ATOMIC_BLOCK, leaving interrupts disabled.
+	locked_TakeBaton();
+	uint8_t sreg=Chip.Storage(REG_SREG);
+	if(!(sreg & _BV(SREG_I)))
+	{
+		// main disabled them before handing it over
+		locked_GiveBaton();
+		return false;
+	}
+	locked_EnableInterrupts(sreg, false);
+	return true;
 }
 
-void ATtiny::IntStop()
+void ATtiny::IntStop(InterruptController::Vector vector)
 {
 	QMutexLocker locker(&Mutex);
+	Chip.Tone().HandlerEnd(vector);
 	// Interrupts might be enabled or disabled, but the irq handler
 	// wouldn't be running unless they started out enabled, so I assume
 	// you always leave interrupts enabled, but I don't know for sure
 	// if there is a way on the hardware that they would remain disabled.
-	locked_EnableInterrupts(true);
-	--ThreadsRunning;
-	Cond.wakeAll();
+	locked_GiveBaton();
+	++IntHandled;
+	HandledTime=TimerEvents.Now();
+	uint8_t sreg=Chip.Storage(REG_SREG);
+	if(!(sreg & _BV(SREG_I)))
+		locked_EnableInterrupts(sreg, true);
+	// a sleeping main thread waits for this
+	locked_Wake(&MainCond, MainWaiting);
 }
 
-void ATtiny::locked_EnableInterrupts(bool enable)
+void ATtiny::locked_EnableInterrupts(uint8_t sreg, bool enable)
 {
-	uint8_t sreg=Chip.GetValue(REG_SREG);
 	if(enable)
-	{
 		sreg |= _BV(SREG_I);
-		Cond.wakeAll();
+	else
+		sreg &= ~_BV(SREG_I);
+	Chip.Storage(REG_SREG)=sreg;
+}
+
+void ATtiny::locked_MainWaitRun()
+{
+	int wakes=0;
+	while(!Baton.empty() && !Stopping)
+	{
+		locked_Wait(&MainBaton.Cond, &MainBaton.Waiting);
+		++wakes;
+	}
+	ThrowIfStopped();
+	if(wakes)
+		Wakes.Spurious+=wakes-1;
+}
+
+void ATtiny::Yield()
+{
+	QMutexLocker locker(&Mutex);
+	QThread *self=QThread::currentThread();
+	if(!BatonWanted || Baton.empty() || Baton.back()!=self)
+		return;
+	// leave it for the waiting handler, it is back when that returns
+	Baton.push_back(NULL);
+	++Wakes.Handoffs;
+	locked_WakeBaton();
+	BatonWaiter &waiter=Waiter(self);
+	int wakes=0;
+	while(Baton.back()!=self && !Stopping)
+	{
+		locked_Wait(&waiter.Cond, &waiter.Waiting);
+		++wakes;
+	}
+	if(wakes)
+		Wakes.Spurious+=wakes-1;
+}
+
+void ATtiny::locked_TakeBaton()
+{
+	QThread *self=QThread::currentThread();
+	// The holder running its own handler keeps it.
+	if(Baton.empty() || Baton.back()==self)
+	{
+		Baton.push_back(self);
+		return;
+	}
+	// the stall detector, see YieldPoint, and a holder still spinning
+	// since the last forced handler isn't waited for
+	bool wait=!VirtualTime.IsEnabled() && !(Spinning &&
+		Progress.load(std::memory_order_relaxed)==SpinProgress);
+	++BatonWanted;
+	BatonWaiter &waiter=Waiter(self);
+	while(wait && Baton.back() && !Stopping)
+	{
+		++waiter.Waiting;
+		++waiter.Taking;
+		++Wakes.Waits;
+		wait=waiter.Cond.wait(&Mutex, BatonWaitMs);
+		--waiter.Taking;
+		--waiter.Waiting;
+		// the holder could have stopped instead of handing it over
+		if(Baton.empty())
+			break;
+		// woken and it still wasn't handed over
+		if(wait && Baton.back() && !Stopping)
+			++Wakes.Spurious;
 	}
+	--BatonWanted;
+	Spinning=false;
+	if(Baton.empty())
+		Baton.push_back(self);
+	else if(!Baton.back())
+		Baton.back()=self;
 	else
 	{
-		sreg &= ~_BV(SREG_I);
+		++Wakes.Forced;
+		Spinning=true;
+		SpinProgress=Progress.load(std::memory_order_relaxed);
+	}
+}
+
+void ATtiny::locked_GiveBaton()
+{
+	// a forced handler never had it
+	if(Baton.empty() || Baton.back()!=QThread::currentThread())
+		return;
+	Baton.pop_back();
+	locked_WakeBaton();
+}
+
+void ATtiny::locked_Woke(uint64_t start)
+{
+	SleepFrom=IntHandled;
+	Chip.Tone().Woke();
+	uint64_t now=TimerEvents.Now();
+	uint64_t latency=now > HandledTime ? now-HandledTime : 0;
+	++Sleeps.Count;
+	Sleeps.Slept+=now-start;
+	Sleeps.LatencySum+=latency;
+	if(latency > Sleeps.LatencyMax)
+		Sleeps.LatencyMax=latency;
+}
+
+void ATtiny::locked_Wait(QWaitCondition *cond, int *waiting)
+{
+	++*waiting;
+	++Wakes.Waits;
+	cond->wait(&Mutex);
+	--*waiting;
+}
+
+void ATtiny::locked_Wake(QWaitCondition *cond, int waiting)
+{
+	if(!waiting)
+		return;
+	++Wakes.Wakeups;
+	cond->wakeOne();
+}
+
+void ATtiny::locked_WakeBaton()
+{
+	// A holder is waiting in Yield to get it back.
+	if(!Baton.empty() && Baton.back())
+	{
+		BatonWaiter &waiter=Waiter(Baton.back());
+		locked_Wake(&waiter.Cond, waiter.Waiting);
+		return;
 	}
-	Chip=RegValue(REG_SREG, sreg);
+	// Handed over or free, a handler waiting to take it runs first like
+	// a pending interrupt, when it is free the main thread can have it.
+	if(HandlerBaton.Taking)
+		locked_Wake(&HandlerBaton.Cond, HandlerBaton.Waiting);
+	else if(MainBaton.Taking || Baton.empty())
+		locked_Wake(&MainBaton.Cond, MainBaton.Waiting);
+}
+
+void ATtiny::SetSREG(RegOp op, uint8_t value)
+{
+	StopPoint();
+	YieldPoint();
+	QMutexLocker locker(&Mutex);
+	uint8_t before=Chip.Storage(REG_SREG);
+	uint8_t after=RegApply(op, before, value);
+	Chip.Storage(REG_SREG)=after;
+	if(after & ~before & _BV(SREG_I))
+		locked_MarkSleep();
 }
@@ -27,18 +27,99 @@ hardware buttons and LEDs.
 #include <QWaitCondition>
 #include <QMutexLocker>
 #include <QThread>
+#include <vector>
+#include <exception>
 #include "avr/io.h"
 #include "ATtinyChip.h"
+#include "VirtualClock.h"
+#include "InterruptController.h"
 
 class HallKeypad;
 
 /* This class wraps the main ATtinyChip to provide thread safe operations
  * so that ATtinyChip doesn't need to do any locking interally.
+ *
+ * Each ATtiny is an independent chip running its own copy of the program,
+ * any number of them can run in one process.
  */
 class ATtiny
 {
 public:
 	ATtiny();
+	// Stops the timers, the program must not be running, see Stop.
+	~ATtiny();
+
+	/* Load the program from the shared object at path, returns false
+	 * on error.  dlopen returns the existing handle when a file is
+	 * loaded again, so a private copy of the file is loaded, giving
+	 * this chip its own program globals and RegContext.
+	 */
+	bool Load(const char *path);
+	/* Use the program context and its dlopen image handle (which can
+	 * be RTLD_DEFAULT), main is the program's avr_main.  Load calls
+	 * this, or call it directly for a program linked in.
+	 */
+	void Attach(RegContext *context, void *image, int (*main)());
+	/* Run the program's main on the calling thread, will not return
+	 * as long as the program is executing.  Returns what main returned,
+	 * or -1 if it was stopped.
+	 */
+	int Run();
+	/* Ask the program to stop, can be called from any thread including
+	 * a TimerScheduler event.  The next time the main thread calls into
+	 * the emulator outside of an ATOMIC_BLOCK it throws Stopped,
+	 * unwinding out of the program to Run.  A program spinning without
+	 * touching a register or delaying never gets there.  The chip can't
+	 * be run again.
+	 */
+	void Stop();
+	bool IsStopped() const { return Stopping; }
+	struct Stopped {};
+	/* Throws Stopped on the main thread after Stop, called on the way
+	 * into the emulator before any lock is taken.  The ATOMIC_BLOCK
+	 * cleanup writes SREG, a throw in the block would have it throw
+	 * again while unwinding, so it waits for the block to exit, and
+	 * never throws while unwinding.  A call requested with
+	 * RequestMainCall runs here first.
+	 */
+	void StopPoint()
+	{
+		if(MainCall.load(std::memory_order_relaxed))
+			RunMainCall();
+		ThrowIfStopped();
+	}
+	/* Virtual time, run client's Expire on the main thread the next time
+	 * it calls into the emulator, with no events running on another
+	 * thread, see TimerScheduler::RunExclusive.  For an event that has
+	 * to be on the main thread and ran on the stall detector's thread
+	 * instead, the program was spinning.  A later request replaces one
+	 * that hasn't run.
+	 */
+	void RequestMainCall(TimerScheduler::Client *client)
+	{
+		MainCall=client;
+	}
+	// Switch to virtual time, see VirtualClock::Enable.
+	void EnableVirtualTime();
+
+	/* Save the chip to state, or restore a saved one.  The state has
+	 * the registers, the timers and interrupt flags, the keypad, and
+	 * the program's global variables (its .data and .bss, the EEMEM
+	 * variables are there too).  The times are relative and pointers
+	 * into the program are moved to where it is loaded, so it can be
+	 * restored into another chip, or another process, that loaded the
+	 * same program file.  Call them from a TimerScheduler event with
+	 * virtual time, the main thread is stopped in the emulator then.
+	 *
+	 * The program's stack isn't saved, the main thread continues from
+	 * where it is in the restored chip, so the program has to be at
+	 * the same place in both with its state in globals, such as a main
+	 * loop sleeping between interrupts (dfries_capture).  Returns false
+	 * if the program wasn't loaded with Load, or the state isn't from
+	 * the same program.
+	 */
+	bool SaveState(std::vector<uint8_t> *state);
+	bool RestoreState(const std::vector<uint8_t> &state);
 
 	void SetPeripheral(HallKeypad *keypad)
 	{
@@ -49,21 +130,60 @@ public:
 	/* The microprocessor has the main thread execution and interrupts.
 	 * There is only one CPU and so they are never executing concurrently,
 	 * but the interrupts can happen any time interrupts are enabled,
-	 * leading to the same kinds of concurrency problems.  To prevent
-	 * the main function and interrputs from runing at the same time,
-	 * call this function from each thread so they will only run on
-	 * one CPU and never at the same time.  This will allow them to
-	 * task share, but if that's a problem the microcontroller code
-	 * probably has problems anyway.
+	 * leading to the same kinds of concurrency problems.  Each chip has
+	 * an execution baton, only the thread holding it runs the program.
+	 * The main thread holds it while running, and an interrupt handler
+	 * on another thread waits for the holder to hand it over at the
+	 * next YieldPoint, and gives it back when the handler returns, the
+	 * holder picks up where it left off like the hardware returning
+	 * from an interrupt.  Chips don't share anything, so each can run on
+	 * any CPU.
+	 *
+	 * A program spinning without calling into the emulator never gets
+	 * to a YieldPoint, so a handler that waited BatonWaitMs runs
+	 * without the baton, concurrently, and is counted in Forced.  That
+	 * gives up the exclusion, a forced handler can run in the middle of
+	 * main's ATOMIC_BLOCK, in return for the program not hanging.  Once
+	 * a handler was forced, the next ones don't wait either until the
+	 * holder reaches a YieldPoint again, a main loop spinning on a
+	 * volatile would otherwise hold the scheduler thread BatonWaitMs on
+	 * every event.  With virtual time the handlers only run on another
+	 * thread when the stall detector found the main thread spinning,
+	 * they don't wait.
 	 */
-	static void SetThreadAffinity();
+	enum
+	{
+		BatonWaitMs=1
+	};
+	// Called on the way into the emulator before any lock is taken,
+	// hands the baton to a waiting interrupt handler.
+	void YieldPoint()
+	{
+		// not a read-modify-write, it only has to change
+		Progress.store(Progress.load(std::memory_order_relaxed)+1,
+			std::memory_order_relaxed);
+		if(BatonWanted)
+			Yield();
+	}
 
 	/* Call once to store which thread is the main thread.
 	 * This is used to find out when the behavior is different
 	 * between the main thread and interrupts.
 	 */
-	void RegisterMainThread() { MainThread=QThread::currentThread(); }
-	bool IsMain() { return MainThread==QThread::currentThread(); }
+	void RegisterMainThread();
+	/* Call on the main thread in a child process forked from it, the
+	 * main thread's CPU clock and the stall detector are new, see
+	 * TimerScheduler::AfterFork.
+	 */
+	void AfterFork();
+	// The calling thread is the main thread, running main or a handler.
+	bool OnMainThread() { return MainThread==QThread::currentThread(); }
+	// An interrupt handler run from the main thread isn't main.
+	bool IsMain()
+	{
+		return MainThread==QThread::currentThread() &&
+			!InterruptController::InHandler();
+	}
 
 	/* These functions exist to do the thread synchronization required
 	 * to emulate a main program and interrupt handlers.  That means
@@ -71,9 +191,8 @@ public:
 	 * interrupt thread may run while the other are blocked, that is
 	 * also how atomic operations are implemented on the chip, if the
 	 * interrupts (or main thread when in an interrupt), can't run
-	 * it looks like it is atomic.  See SetThreadAffinity for how only
-	 * one thread is executing at a time, they will be allowed to
-	 * task switch, which isn't how the hardware works.
+	 * it looks like it is atomic.  The baton, see YieldPoint, is how
+	 * only one thread is executing at a time.
 	 *
 	 * Interrupt handlers are executed with global interrupts initially
 	 * disabled, until they are enabled only one interrupt handler can
@@ -82,71 +201,218 @@ public:
 	 */
 	void MainStart();
 	void MainStop();
-	void IntStart();
-	void IntStop();
+	/* Start an interrupt handler, false if interrupts are disabled,
+	 * the handler is left pending and dispatched again when they are
+	 * enabled, see RegInterruptEnable.
+	 */
+	bool IntTryStart();
+	// vector is the handler that ran, if any, see HandlerStart
+	void IntStop(InterruptController::Vector vector=
+		InterruptController::VectorReset);
+	// After IntTryStart, the handler for vector is about to run.
+	void HandlerStart(InterruptController::Vector vector)
+	{
+		QMutexLocker locker(&Mutex);
+		Chip.Tone().HandlerStart(vector);
+	}
 	/* Causes the main thread to sleep until an interrupt handler
-	 * returns.  Unlike the real hardare there is a race condition.
-	 * In the hardware enabling interrupts followed by sleep guarantees
-	 * that the sleep will be executed before any interrupt goes off,
-	 * but that's currently not the case here, an interrupt can be
-	 * missed between those two calls.
+	 * returns.  In the hardware enabling interrupts followed by sleep
+	 * guarantees that the sleep will be executed before any interrupt
+	 * goes off.  Here the handler can run first, so the count of
+	 * handlers is saved when the main thread enables interrupts and
+	 * the sleep returns right away if any ran since then (or since the
+	 * last sleep).  With virtual time the time is moved to each timer
+	 * event until a handler runs.
 	 */
 	void MainSleep();
-	void EnableInterrupts(bool enable)
+	// thread wakeup counts
+	struct WakeStats
+	{
+		// times a thread waited
+		uint64_t Waits;
+		// wakeups signaled
+		uint64_t Wakeups;
+		// woke up and still couldn't run
+		uint64_t Spurious;
+		// baton handed to an interrupt handler at a YieldPoint
+		uint64_t Handoffs;
+		// interrupt handlers run without the baton
+		uint64_t Forced;
+	};
+	WakeStats GetWakeStats()
 	{
 		QMutexLocker locker(&Mutex);
-		locked_EnableInterrupts(enable);
+		return Wakes;
 	}
-
-	// It is using the operator syntax just to make it obvious what
-	// operation they represent.
-	const ATtiny& operator=(RegValue arg)
+	// MainSleep counts, times are in oscillator cycles
+	struct SleepStats
+	{
+		uint64_t Count;
+		// total time asleep
+		uint64_t Slept;
+		// from the handler returning to the main thread running
+		uint64_t LatencySum;
+		uint64_t LatencyMax;
+	};
+	SleepStats GetSleepStats()
 	{
 		QMutexLocker locker(&Mutex);
-		Chip=arg;
-		return *this;
+		return Sleeps;
 	}
-	const ATtiny& operator+=(RegValue arg)
+	void EnableInterrupts(bool enable)
 	{
+		StopPoint();
+		YieldPoint();
 		QMutexLocker locker(&Mutex);
-		Chip+=arg;
-		return *this;
+		locked_EnableInterrupts(Chip.Storage(REG_SREG), enable);
+		if(enable)
+			locked_MarkSleep();
 	}
-	const ATtiny& operator-=(RegValue arg)
+
+	// Register writes, set is the ATtinyChip function for the register's
+	// peripheral, called with the lock held.
+	void Set(void (ATtinyChip::*set)(RegEnum, RegOp, uint8_t),
+		RegEnum reg, RegOp op, uint8_t value)
 	{
+		StopPoint();
+		YieldPoint();
 		QMutexLocker locker(&Mutex);
-		Chip-=arg;
-		return *this;
+		Chip.Tone().Write(reg, op, value);
+		(Chip.*set)(reg, op, value);
 	}
-	const ATtiny& operator|=(RegValue arg)
+	// Port writes between these are sent to the keypad together at the
+	// end, see ATtinyChip::BeginTransaction.
+	void BeginTransaction()
 	{
+		if(OnMainThread())
+			++MainAtomic;
 		QMutexLocker locker(&Mutex);
-		Chip|=arg;
-		return *this;
+		Chip.BeginTransaction();
 	}
-	const ATtiny& operator&=(RegValue arg)
+	void EndTransaction()
 	{
+		if(OnMainThread())
+			--MainAtomic;
 		QMutexLocker locker(&Mutex);
-		Chip&=arg;
-		return *this;
+		Chip.EndTransaction();
 	}
-	const ATtiny& operator^=(RegValue arg)
+	// called by delays
+	void FlushPorts()
 	{
 		QMutexLocker locker(&Mutex);
-		Chip^=arg;
-		return *this;
+		Chip.Tone().Activity();
+		Chip.FlushPorts();
 	}
+	// SREG enables or disables interrupts when the I bit changes.
+	void SetSREG(RegOp op, uint8_t value);
+	// Registers with a computed value, the rest are read directly.
 	uint8_t GetValue(RegEnum reg)
 	{
+		StopPoint();
+		YieldPoint();
 		QMutexLocker locker(&Mutex);
+		Chip.Tone().Read(reg);
 		return Chip.GetValue(reg);
 	}
+	// Virtual time if enabled, it does its own locking.
+	VirtualClock& Clock() { return VirtualTime; }
+	// Runs the timer events.
+	TimerScheduler& Scheduler() { return TimerEvents; }
+	// Interrupt flags and handlers.
+	InterruptController& Interrupts() { return IrqControl; }
+	// Turn the ToneOscillator on or off, it is on by default.
+	void EnableToneOscillator(bool enable)
+	{
+		QMutexLocker locker(&Mutex);
+		Chip.Tone().Enable(enable);
+	}
+	ToneOscillator::Stats GetToneStats()
+	{
+		QMutexLocker locker(&Mutex);
+		return Chip.Tone().GetStats();
+	}
+	/* A hash of the program's globals, to see if they changed, false
+	 * if the program wasn't loaded with Load.  Call with the program
+	 * stopped in the emulator.
+	 */
+	bool ProgramHash(uint64_t *hash);
 private:
+	// constructed before Chip which uses them
+	VirtualClock VirtualTime;
+	TimerScheduler TimerEvents;
+	InterruptController IrqControl;
 	ATtinyChip Chip;
 	QMutex Mutex;
-	QWaitCondition Cond;
-	int ThreadsRunning;
+	/* A sleeping main thread waits on MainCond for a handler to
+	 * return.  The threads waiting for the baton each have their own
+	 * condition, the main thread and the handler context (the
+	 * TimerScheduler thread), a baton change wakes only the one that
+	 * can run next, see locked_WakeBaton.
+	 */
+	QWaitCondition MainCond;
+	struct BatonWaiter
+	{
+		BatonWaiter() : Waiting(0), Taking(0) {}
+		QWaitCondition Cond;
+		// waiting on Cond, and of those waiting in locked_TakeBaton
+		int Waiting;
+		int Taking;
+	};
+	BatonWaiter MainBaton;
+	BatonWaiter HandlerBaton;
+	// threads waiting on MainCond
+	int MainWaiting;
+	/* The baton holder is last, the threads it was taken from are
+	 * before it, empty when nobody holds it.  A NULL last is a baton
+	 * handed over and not yet taken.  The main thread running its own
+	 * handlers (virtual time) is in it once for each.
+	 */
+	std::vector<QThread*> Baton;
+	// interrupt handlers waiting for the baton
+	std::atomic<int> BatonWanted;
+	// changed at every YieldPoint, Spinning is set when a handler was
+	// forced and SpinProgress is Progress then
+	std::atomic<uint32_t> Progress;
+	bool Spinning;
+	uint32_t SpinProgress;
+	// incremented each time an interrupt handler returns, the last
+	// one at HandledTime
+	uint32_t IntHandled;
+	uint64_t HandledTime;
+	// IntHandled when main last enabled interrupts or woke up
+	uint32_t SleepFrom;
+	WakeStats Wakes;
+	SleepStats Sleeps;
 	QThread *MainThread;
+	// the loaded program, closed if the program isn't running
+	RegContext *Context;
+	void *Image;
+	/* The program's .data and .bss, offsets from where it is loaded,
+	 * and the size of the whole image, found by Load for SaveState.
+	 */
+	enum { DataSections=2 };
+	struct Section
+	{
+		uintptr_t Offset;
+		size_t Size;
+	} Data[DataSections];
+	uintptr_t ImageSize;
+	int (*Main)();
+	bool Running;
+	std::atomic<bool> Stopping;
+	// ATOMIC_BLOCKs the main thread is in, only it uses this
+	int MainAtomic;
+	// see RequestMainCall
+	std::atomic<TimerScheduler::Client*> MainCall;
+	void RunMainCall();
+	// StopPoint without running the call, it can be called with Mutex
+	// held
+	void ThrowIfStopped()
+	{
+		if(Stopping && MainThread==QThread::currentThread() &&
+			!MainAtomic && !std::uncaught_exception())
+			throw Stopped();
+	}
 
 	// Mutex must be held
 	// returns true if interrupts are enabled
@@ -155,10 +421,44 @@ private:
 		return Chip.GetValue(REG_SREG) & _BV(SREG_I);
 	}
 	// Mutex must be held
-	// interrupts are enabled if enable is true
-	void locked_EnableInterrupts(bool enable);
+	// store sreg, SREG as the caller read it, with interrupts enabled
+	// if enable is true
+	void locked_EnableInterrupts(uint8_t sreg, bool enable);
+	// Mutex must be held
+	// MainStart's wait for the main thread to be allowed to run
+	void locked_MainWaitRun();
+	// hand the baton over if this thread holds it, see YieldPoint
+	void Yield();
+	// Where the loaded program is, false if it wasn't loaded by Load.
+	bool ImageBase(uintptr_t *base);
+	// Read Data and ImageSize from the ELF file at path.
+	bool FindData(const char *path);
+	// Mutex must be held
+	// interrupt handler start and stop, take the baton and give it back
+	void locked_TakeBaton();
+	void locked_GiveBaton();
+	// Mutex must be held
+	// the main thread enabled interrupts, see MainSleep
+	void locked_MarkSleep()
+	{
+		if(IsMain())
+			SleepFrom=IntHandled;
+	}
+	// Mutex must be held
+	// MainSleep is returning, sleep started at start
+	void locked_Woke(uint64_t start);
+	// Mutex must be held
+	// wait on cond counted in waiting, wake one if any are waiting
+	void locked_Wait(QWaitCondition *cond, int *waiting);
+	void locked_Wake(QWaitCondition *cond, int waiting);
+	// the baton waiter for thread
+	BatonWaiter& Waiter(QThread *thread)
+	{
+		return thread==MainThread ? MainBaton : HandlerBaton;
+	}
+	// Mutex must be held
+	// the baton changed hands, wake the thread that runs next
+	void locked_WakeBaton();
 };
 
-extern ATtiny g_ATtiny;
-
 #endif // _AT_TINY_H
@@ -21,151 +21,184 @@ hardware buttons and LEDs.
 */
 
 #include "ATtinyChip.h"
-#include "HallKeypad.h"
 #include "Timer0.h"
 #include "Timer1.h"
+#include "VirtualClock.h"
+#include "TimerScheduler.h"
+#include "HallKeypad.h"
+#include "InterruptController.h"
+#include "ChipState.h"
 
-ATtinyChip::ATtinyChip() :
+ATtinyChip::ATtinyChip(ATtiny *owner, VirtualClock *clock,
+	TimerScheduler *scheduler, InterruptController *interrupts) :
+	Owner(owner),
 	Keypad(NULL),
+	TransactionDepth(0),
+	PortWriteCount(0),
+	Clock(clock),
+	Scheduler(scheduler),
+	Interrupts(interrupts),
 	TimerObj0(NULL),
 	TimerObj1(NULL),
-	SystemClockHz(1000000) // ATtiny2313 default, selectable by fuses
+	SystemClockHz(1000000), // ATtiny2313 default, selectable by fuses
+	Oscillator(owner, this, &Bus)
 {
-	memset(Reg, 0, sizeof(Reg));
+	for(int i=0; i<RegCount; ++i)
+		Reg[i]=0;
 }
 
-const ATtinyChip& ATtinyChip::operator=(RegValue arg)
+ATtinyChip::~ATtinyChip()
 {
-	return Set(arg.Reg, [arg](uint8_t &v) { v=arg.Value; });
+	delete TimerObj0;
+	delete TimerObj1;
 }
 
-const ATtinyChip& ATtinyChip::operator+=(RegValue arg)
+void ATtinyChip::SetPeripheral(HallKeypad *keypad)
 {
-	return Set(arg.Reg, [arg](uint8_t &v) { v+=arg.Value; });
+	Keypad=keypad;
+	Keypad->SetTimeSource(Scheduler);
+	Keypad->Attach(&Bus);
 }
 
-const ATtinyChip& ATtinyChip::operator-=(RegValue arg)
+bool ATtinyChip::Apply(RegEnum reg, RegOp op, uint8_t value, uint8_t *v,
+	bool always)
 {
-	return Set(arg.Reg, [arg](uint8_t &v) { v-=arg.Value; });
+	uint8_t copy=Reg[reg];
+	*v=RegApply(op, copy, value);
+	if(*v==copy && !always)
+		return false;
+	Reg[reg]=*v;
+	return true;
 }
 
-const ATtinyChip& ATtinyChip::operator|=(RegValue arg)
+void ATtinyChip::SetPort(RegEnum reg, RegOp op, uint8_t value)
 {
-	return Set(arg.Reg, [arg](uint8_t &v) { v|=arg.Value; });
+	uint8_t v;
+	if(!Apply(reg, op, value, &v))
+		return;
+	if(reg==REG_PORTD)
+	{
+		Oscillator.PortWritten();
+		v=Reg[reg];
+	}
+	// For output ports only keep the bits with an output direction,
+	// DDRx is the register just below PORTx.
+	v&=Reg[reg-1];
+	if(!TransactionDepth)
+	{
+		Bus.Write(reg, v);
+		return;
+	}
+	if(PortWriteCount == sizeof(PortWrites)/sizeof(*PortWrites))
+		FlushPorts();
+	PortWrite &write=PortWrites[PortWriteCount++];
+	write.Reg=reg;
+	write.Value=v;
 }
 
-const ATtinyChip& ATtinyChip::operator&=(RegValue arg)
+void ATtinyChip::EndTransaction()
 {
-	return Set(arg.Reg, [arg](uint8_t &v) { v&=arg.Value; });
+	if(!--TransactionDepth)
+		FlushPorts();
 }
 
-const ATtinyChip& ATtinyChip::operator^=(RegValue arg)
+void ATtinyChip::FlushPorts()
 {
-	return Set(arg.Reg, [arg](uint8_t &v) { v^=arg.Value; });
+	if(!PortWriteCount)
+		return;
+	Bus.Write(PortWrites, PortWriteCount);
+	PortWriteCount=0;
 }
 
-const ATtinyChip& ATtinyChip::Set(RegEnum reg, RegOperation op)
+Timer0* ATtinyChip::GetTimer0(uint8_t v)
 {
-	uint8_t v=Reg[reg];
-	uint8_t copy=v;
-	op(v);
-	if(v==copy)
-		return *this;
-	Reg[reg]=v;
+	if(!TimerObj0 && v)
+	{
+		uint8_t reg[RegCount];
+		Snapshot(reg);
+		TimerObj0=new Timer0(Owner, reg);
+		TimerObj0->SetSysteClock(SystemClockHz);
+		Scheduler->AddTimer(TimerObj0);
+	}
+	return TimerObj0;
+}
 
-	// For output ports only keep the bits with an output direction.
-	switch(reg)
+Timer1* ATtinyChip::GetTimer1(uint8_t v)
+{
+	if(!TimerObj1 && v)
 	{
-	case REG_PORTD:
-		v&=Reg[REG_DDRD];
-		break;
-	case REG_PORTB:
-		v&=Reg[REG_DDRB];
-		break;
-	case REG_PORTA:
-		v&=Reg[REG_DDRA];
-		break;
-	default:
-		break;
+		uint8_t reg[RegCount];
+		Snapshot(reg);
+		TimerObj1=new Timer1(Owner, reg);
+		TimerObj1->SetSysteClock(SystemClockHz);
+		Scheduler->AddTimer(TimerObj1);
+		Oscillator.SetTimer(TimerObj1);
 	}
+	return TimerObj1;
+}
 
-	// update peripherals
-	switch(reg)
+void ATtinyChip::SetTimer0(RegEnum reg, RegOp op, uint8_t value)
+{
+	uint8_t v;
+	// Writing a counter sets the count even when it is the same as the
+	// value last written.
+	if(!Apply(reg, op, value, &v, reg==REG_TCNT0))
+		return;
+	if(Timer0 *timer=GetTimer0(v))
+		timer->Set(reg, v);
+}
+
+void ATtinyChip::SetTimer1(RegEnum reg, RegOp op, uint8_t value)
+{
+	uint8_t v;
+	if(!Apply(reg, op, value, &v, reg==REG_TCNT1))
+		return;
+	if(Timer1 *timer=GetTimer1(v))
+		timer->Set(reg, v);
+}
+
+void ATtinyChip::SetTimers(RegEnum reg, RegOp op, uint8_t value)
+{
+	uint8_t v;
+	// writing a 1 to a flag always clears it
+	if(!Apply(reg, op, value, &v, reg==REG_TIFR))
+		return;
+	// The flags and enables are kept by the interrupt controller.
+	if(reg==REG_TIFR)
+		Interrupts->Clear(InterruptController::FromTimerBits(v));
+	else
+		Interrupts->SetEnabled(InterruptController::TimerVectors,
+			InterruptController::FromTimerBits(v));
+}
+
+void ATtinyChip::SetClock(RegEnum reg, RegOp op, uint8_t value)
+{
+	uint8_t v;
+	if(!Apply(reg, op, value, &v))
+		return;
+	// clock change lock-out not implemented, assume the program
+	// is doing it correctly
+	if(v == _BV(CLKPCE))
+		return;
+	if(v > 8)
 	{
-	case REG_CLKPR:
-		// clock change lock-out not implemented, assume the program
-		// is doing it correctly
-		if(v == _BV(CLKPCE))
-			break;
-		if(v > 8)
-		{
-			printf("ATtinyChip::Set invalid CLKPR value %u\n", v);
-			break;
-		}
-		SystemClockHz=8000000 / (1<<v);
-		if(TimerObj0)
-			TimerObj0->SetSysteClock(SystemClockHz);
-		if(TimerObj1)
-			TimerObj1->SetSysteClock(SystemClockHz);
-		break;
-	case REG_PORTD:
-	case REG_PORTB:
-	case REG_PORTA:
-		if(Keypad)
-			Keypad->SetPort(reg, v);
-		break;
-	case REG_TCCR0A:
-	case REG_TCCR0B:
-	case REG_TCNT0:
-	case REG_OCR0A:
-	case REG_OCR0B:
-	case REG_TIMSK:
-	case REG_TIFR:
-		// Only allocate on the first non-zero write.
-		if(!TimerObj0 && v)
-		{
-			TimerObj0=new Timer0(Reg);
-			TimerObj0->SetSysteClock(SystemClockHz);
-			TimerObj0->start();
-		}
-		if(TimerObj0)
-			TimerObj0->Set(reg, v);
-		// Fall through for REG_TIMSK or REG_TIFR as TimerObj1 needs
-		// them as well.
-		if(reg != REG_TIMSK && reg != REG_TIFR)
-			break;
-	case REG_TCCR1A:
-	case REG_TCCR1B:
-	case REG_TCCR1C:
-	case REG_TCNT1:
-	case REG_TCNT1H:
-	case REG_OCR1A:
-	case REG_OCR1AH:
-	case REG_OCR1B:
-	case REG_OCR1BH:
-	case REG_ICR1:
-	case REG_ICR1H:
-		// Only allocate on the first non-zero write.
-		if(!TimerObj1 && v)
-		{
-			TimerObj1=new Timer1(Reg);
-			TimerObj1->SetSysteClock(SystemClockHz);
-			TimerObj1->start();
-		}
-		if(TimerObj1)
-			TimerObj1->Set(reg, v);
-		break;
-	// registers that just need to update the register store
-	case REG_DDRD:
-	case REG_DDRB:
-	case REG_DDRA:
-	case REG_SREG: // interrupt concurrency is handled in ATtiny
-		break;
-	default:
-		printf("unhandled register 0x%2x\n", reg);
-		break;
+		printf("ATtinyChip::Set invalid CLKPR value %u\n", v);
+		return;
 	}
-	return *this;
+	SystemClockHz=8000000 / (1<<v);
+	Clock->SetCpuDivide(1<<v);
+	if(TimerObj0)
+		TimerObj0->SetSysteClock(SystemClockHz);
+	if(TimerObj1)
+		TimerObj1->SetSysteClock(SystemClockHz);
+}
+
+void ATtinyChip::SetOther(RegEnum reg, RegOp op, uint8_t value)
+{
+	uint8_t v;
+	if(!Apply(reg, op, value, &v))
+		return;
+	printf("unhandled register 0x%2x\n", reg);
 }
 
 uint8_t ATtinyChip::GetValue(RegEnum reg)
@@ -173,6 +206,8 @@ uint8_t ATtinyChip::GetValue(RegEnum reg)
 	switch(reg)
 	{
 	case REG_PINB:
+		// the output enables can be queued
+		FlushPorts();
 		if(Keypad)
 		return Keypad->GetPort(reg);
 	// Only the counter and interrupt flag registers are modified
@@ -185,18 +220,78 @@ uint8_t ATtinyChip::GetValue(RegEnum reg)
 		if(TimerObj1)
 			return TimerObj1->Get(reg);
 	case REG_TIFR:
-		{
-			// Each timer has different bits in the same
-			// register, combine them into one.
-			uint8_t flags=0;
-			if(TimerObj0)
-				flags |= TimerObj0->Get(reg);
-			if(TimerObj1)
-				flags |= TimerObj1->Get(reg);
-			return flags;
-		}
+		return InterruptController::ToTimerBits(
+			Interrupts->GetPending());
 	default:
 		break;
 	}
 	return Reg[reg];
 }
+
+void ATtinyChip::Snapshot(uint8_t *reg)
+{
+	for(int i=0; i<RegCount; ++i)
+		reg[i]=Reg[i];
+}
+
+void ATtinyChip::SaveState(ChipState *state, uint64_t now)
+{
+	// the handler takes over again, it is in the saved state
+	Oscillator.Stop();
+	FlushPorts();
+	for(int i=0; i<RegCount; ++i)
+		state->Put((uint8_t)Reg[i]);
+	state->Put(SystemClockHz);
+	state->Put(TimerObj0!=NULL);
+	if(TimerObj0)
+		TimerObj0->SaveState(state, now);
+	state->Put(TimerObj1!=NULL);
+	if(TimerObj1)
+		TimerObj1->SaveState(state, now);
+	state->Put(Interrupts->GetPending());
+	for(int i=0; i<PinBus::PortCount; ++i)
+		state->Put(Bus.Get((PinBus::Port)i));
+	state->Put(Keypad!=NULL);
+	if(Keypad)
+		Keypad->SaveState(state);
+}
+
+void ATtinyChip::RestoreState(ChipState *state, uint64_t now)
+{
+	Oscillator.Stop();
+	PortWriteCount=0;
+	for(int i=0; i<RegCount; ++i)
+		Reg[i]=state->Get<uint8_t>();
+	uint32_t hz=state->Get<uint32_t>();
+	if(hz)
+	{
+		SystemClockHz=hz;
+		Clock->SetCpuDivide(8000000 / hz);
+	}
+	if(state->Get<bool>())
+		GetTimer0(1)->RestoreState(state, now);
+	else if(TimerObj0)
+		TimerObj0->Stop();
+	if(state->Get<bool>())
+		GetTimer1(1)->RestoreState(state, now);
+	else if(TimerObj1)
+		TimerObj1->Stop();
+	Interrupts->SetPending(state->Get<uint32_t>());
+	Interrupts->SetEnabled(InterruptController::TimerVectors,
+		InterruptController::FromTimerBits(Reg[REG_TIMSK]));
+	PortWrite writes[PinBus::PortCount]=
+	{
+		{REG_PORTA, 0},
+		{REG_PORTB, 0},
+		{REG_PORTD, 0}
+	};
+	for(int i=0; i<PinBus::PortCount; ++i)
+		writes[i].Value=state->Get<uint8_t>();
+	Bus.Write(writes, PinBus::PortCount);
+	// a keypad that wasn't saved keeps its state
+	if(state->Get<bool>())
+	{
+		HallKeypad unused;
+		(Keypad ? Keypad : &unused)->RestoreState(state);
+	}
+}
@@ -24,11 +24,19 @@ hardware buttons and LEDs.
 #define _AT_TINY_CHIP_H
 
 #include <avr/io.h>
-#include <functional>
+#include <atomic>
+#include "PinBus.h"
+#include "ToneOscillator.h"
 
 class HallKeypad;
+class ATtiny;
+class ChipState;
+
 class Timer0;
 class Timer1;
+class VirtualClock;
+class TimerScheduler;
+class InterruptController;
 
 /* This class keeps track of the ATtiny register states and requied
  * emulations.  Use the ATtiny class as a wrapper when accessing the
@@ -37,29 +45,81 @@ class Timer1;
 class ATtinyChip
 {
 public:
-	ATtinyChip();
-	void SetPeripheral(HallKeypad *keypad) { Keypad = keypad; }
-	// It is using the operator syntax just to make it obvious what
-	// operation they represent.
-	const ATtinyChip& operator=(RegValue arg);
-	const ATtinyChip& operator+=(RegValue arg);
-	const ATtinyChip& operator-=(RegValue arg);
-	const ATtinyChip& operator|=(RegValue arg);
-	const ATtinyChip& operator&=(RegValue arg);
-	const ATtinyChip& operator^=(RegValue arg);
+	enum
+	{
+		// register file size, REG_SREG is the last one
+		RegCount=REG_SREG+1
+	};
+	// owner is the ATtiny wrapping this chip, the timers use it
+	ATtinyChip(ATtiny *owner, VirtualClock *clock,
+		TimerScheduler *scheduler, InterruptController *interrupts);
+	// the scheduler must be stopped first
+	~ATtinyChip();
+	// The keypad subscribes to the port pins it is connected to.
+	void SetPeripheral(HallKeypad *keypad);
+	/* Register writes, one for each RegClass in avr/io.h so the
+	 * register objects call the one for their peripheral directly.
+	 * The register is updated with op and value, and the peripheral
+	 * with the result.
+	 */
+	void SetPort(RegEnum reg, RegOp op, uint8_t value);
+	void SetTimer0(RegEnum reg, RegOp op, uint8_t value);
+	void SetTimer1(RegEnum reg, RegOp op, uint8_t value);
+	void SetTimers(RegEnum reg, RegOp op, uint8_t value);
+	void SetClock(RegEnum reg, RegOp op, uint8_t value);
+	void SetOther(RegEnum reg, RegOp op, uint8_t value);
 	uint8_t GetValue(RegEnum reg);
+	/* Port writes made in a transaction are queued and written to the
+	 * pin bus in one call when the outermost transaction ends, or
+	 * before a port is read, instead of one call for each write.
+	 */
+	void BeginTransaction() { ++TransactionDepth; }
+	void EndTransaction();
+	// Write any queued port writes to the pin bus.
+	void FlushPorts();
+	// The register value, storage only registers are accessed directly
+	// through the program's RegContext.
+	std::atomic<uint8_t>& Storage(RegEnum reg) { return Reg[reg]; }
+	// The register file for RegContext::File.
+	std::atomic<uint8_t>* File() { return Reg; }
+	// Takes over from a handler that only plays a tone.
+	ToneOscillator& Tone() { return Oscillator; }
+	/* Append the registers, the timers, the interrupt flags, the
+	 * output port pins, and the keypad to state, see ATtiny::SaveState.
+	 * RestoreState also updates the clock and the interrupt enables
+	 * from the registers, and writes the pins to the bus.
+	 */
+	void SaveState(ChipState *state, uint64_t now);
+	void RestoreState(ChipState *state, uint64_t now);
 private:
-	// Allow all the various assignment operations to be a lambda callback
-	// to have a common before and after callback.
-	typedef std::function<void (uint8_t &v)> RegOperation;
-
-	const ATtinyChip& Set(RegEnum reg, RegOperation op);
+	/* Apply op to reg storing the result in v, returns false if the
+	 * value didn't change and the peripheral doesn't need an update,
+	 * unless always is set.
+	 */
+	bool Apply(RegEnum reg, RegOp op, uint8_t value, uint8_t *v,
+		bool always=false);
+	// Allocate the timer on the first non-zero write.
+	Timer0* GetTimer0(uint8_t v);
+	Timer1* GetTimer1(uint8_t v);
+	// Copy the register values for a new timer.
+	void Snapshot(uint8_t *reg);
 
-	uint8_t Reg[REG_SREG];
+	std::atomic<uint8_t> Reg[RegCount];
+	ATtiny *Owner;
 	HallKeypad *Keypad;
+	// output port pins
+	PinBus Bus;
+	int TransactionDepth;
+	// A LED update is 6 writes, more than this flushes early.
+	PortWrite PortWrites[16];
+	size_t PortWriteCount;
+	VirtualClock *Clock;
+	TimerScheduler *Scheduler;
+	InterruptController *Interrupts;
 	Timer0 *TimerObj0;
 	Timer1 *TimerObj1;
 	uint32_t SystemClockHz;
+	ToneOscillator Oscillator;
 };
 
 #endif // _AT_TINY_CHIP_H
@@ -0,0 +1,295 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include "ButtonLog.h"
+#include "ATtiny.h"
+#include "HallKeypad.h"
+
+static const char Magic[3]={'K', 'P', 'B'};
+
+ButtonRecorder::ButtonRecorder(ATtiny *chip) :
+	Chip(chip),
+	File(NULL),
+	Last(0),
+	Buttons(0)
+{
+}
+
+ButtonRecorder::~ButtonRecorder()
+{
+	Close();
+}
+
+bool ButtonRecorder::Open(const char *path)
+{
+	QMutexLocker locker(&Mutex);
+	File=fopen(path, "wb");
+	if(!File)
+	{
+		perror(path);
+		return false;
+	}
+	uint8_t header[5]={(uint8_t)Magic[0], (uint8_t)Magic[1],
+		(uint8_t)Magic[2], ButtonLog::Version,
+		(uint8_t)(Chip->Clock().IsEnabled() ? ButtonLog::VirtualTime :
+			0)};
+	fwrite(header, 1, sizeof(header), File);
+	return true;
+}
+
+void ButtonRecorder::Record(uint16_t buttons)
+{
+	QMutexLocker locker(&Mutex);
+	if(!File || buttons==Buttons)
+		return;
+	uint64_t now=Chip->Scheduler().Now();
+	// the wall clock can be read out of order by two threads
+	uint64_t delta=now > Last ? now - Last : 0;
+	Last+=delta;
+	Buttons=buttons;
+	uint8_t buf[12];
+	size_t len=0;
+	do
+	{
+		buf[len]=delta & 0x7f;
+		delta>>=7;
+		if(delta)
+			buf[len]|=0x80;
+		++len;
+	} while(delta);
+	buf[len++]=buttons;
+	buf[len++]=buttons>>8;
+	fwrite(buf, 1, len, File);
+}
+
+void ButtonRecorder::Close()
+{
+	QMutexLocker locker(&Mutex);
+	if(!File)
+		return;
+	fclose(File);
+	File=NULL;
+}
+
+// Returns false with a message if path can't be read.
+static bool ReadState(const char *path, std::vector<uint8_t> *state)
+{
+	FILE *file=fopen(path, "rb");
+	if(!file)
+	{
+		perror(path);
+		return false;
+	}
+	uint8_t buf[4096];
+	size_t len;
+	while((len=fread(buf, 1, sizeof(buf), file)) > 0)
+		state->insert(state->end(), buf, buf+len);
+	bool ok=!ferror(file);
+	if(!ok)
+		perror(path);
+	fclose(file);
+	return ok;
+}
+
+bool LoadScenario(const char *path, double seconds, Scenario *out,
+	bool states)
+{
+	FILE *file=fopen(path, "r");
+	if(!file)
+	{
+		perror(path);
+		return false;
+	}
+	out->Path=path;
+	out->End=VirtualClock::FromSeconds(seconds);
+	char line[256];
+	int number=0;
+	bool ok=true;
+	while(ok && fgets(line, sizeof(line), file))
+	{
+		++number;
+		if(char *comment=strchr(line, '#'))
+			*comment=0;
+		double time;
+		char value[32];
+		char file_path[200];
+		int count=sscanf(line, "%lf %31s %199s", &time, value,
+			file_path);
+		if(count <= 0)
+			continue;
+		char *end;
+		Scenario::Step step;
+		step.Cycles=VirtualClock::FromSeconds(time);
+		step.Action=Scenario::Step::Press;
+		step.Buttons=0;
+		if(count==2 && !strcmp(value, "end"))
+			out->End=step.Cycles;
+		else if(count==2 && (step.Buttons=strtoul(value, &end, 16),
+			!*end))
+			out->Steps.push_back(step);
+		else if(count==3 && !strcmp(value, "save"))
+		{
+			step.Action=Scenario::Step::Save;
+			step.Path=file_path;
+			out->Steps.push_back(step);
+		}
+		else if(count==3 && !strcmp(value, "restore"))
+		{
+			step.Action=Scenario::Step::Restore;
+			step.Path=file_path;
+			if(states)
+				ok=ReadState(file_path, &step.State);
+			out->Steps.push_back(step);
+		}
+		else
+		{
+			fprintf(stderr, "%s:%d: expected the time and the "
+				"buttons in hex, end, save file, or "
+				"restore file\n", path, number);
+			ok=false;
+		}
+	}
+	fclose(file);
+	std::stable_sort(out->Steps.begin(), out->Steps.end(),
+		[](const Scenario::Step &a, const Scenario::Step &b)
+		{ return a.Cycles < b.Cycles; });
+	return ok;
+}
+
+ButtonPlayer::ButtonPlayer(ATtiny *chip, HallKeypad *keypad) :
+	Chip(chip),
+	Keypad(keypad),
+	Index(0),
+	End(0)
+{
+}
+
+bool ButtonPlayer::Load(const char *path)
+{
+	FILE *file=fopen(path, "rb");
+	if(!file)
+	{
+		perror(path);
+		return false;
+	}
+	uint8_t header[5];
+	size_t len=fread(header, 1, sizeof(header), file);
+	if(len < sizeof(Magic) || memcmp(header, Magic, sizeof(Magic)))
+	{
+		fclose(file);
+		return LoadScript(path);
+	}
+	if(len!=sizeof(header) || header[3]!=ButtonLog::Version)
+	{
+		fprintf(stderr, "%s isn't a button recording\n", path);
+		fclose(file);
+		return false;
+	}
+	if(!(header[4] & ButtonLog::VirtualTime)==Chip->Clock().IsEnabled())
+		fprintf(stderr, "%s was recorded with the %s clock\n", path,
+			header[4] & ButtonLog::VirtualTime ? "virtual" :
+			"wall");
+	Changes.clear();
+	Index=0;
+	Change change={0, 0};
+	bool valid=true;
+	int c;
+	while((c=getc(file))!=EOF)
+	{
+		uint64_t delta=0;
+		int shift=0;
+		for(;;)
+		{
+			delta|=(uint64_t)(c & 0x7f) << shift;
+			shift+=7;
+			if(!(c & 0x80))
+				break;
+			if(shift > 63 || (c=getc(file))==EOF)
+				break;
+		}
+		int low=getc(file);
+		int high=getc(file);
+		if(c==EOF || (c & 0x80) || high==EOF)
+		{
+			valid=false;
+			break;
+		}
+		change.Cycles+=delta;
+		change.Buttons=low | high<<8;
+		Changes.push_back(change);
+	}
+	fclose(file);
+	if(!valid)
+		fprintf(stderr, "%s is truncated, playing %zu changes\n", path,
+			Changes.size());
+	return true;
+}
+
+bool ButtonPlayer::LoadScript(const char *path)
+{
+	Scenario script;
+	// only the button changes are played, the states aren't needed
+	if(!::LoadScenario(path, 0, &script, false))
+		return false;
+	Changes.clear();
+	Index=0;
+	End=script.End;
+	bool skipped=false;
+	for(size_t i=0; i<script.Steps.size(); ++i)
+	{
+		const Scenario::Step &step=script.Steps[i];
+		if(step.Action!=Scenario::Step::Press)
+		{
+			skipped=true;
+			continue;
+		}
+		Change change={step.Cycles, step.Buttons};
+		Changes.push_back(change);
+	}
+	if(skipped)
+		fprintf(stderr, "%s: save and restore are only run by "
+			"keypadalike-batch, skipped\n", path);
+	return true;
+}
+
+void ButtonPlayer::Start()
+{
+	ScheduleNext();
+}
+
+void ButtonPlayer::Expire(uint32_t generation)
+{
+	// changes stamped with the same cycle are applied together
+	uint64_t now=Changes[Index].Cycles;
+	while(Index < Changes.size() && Changes[Index].Cycles==now)
+		Keypad->SetButtons(Changes[Index++].Buttons);
+	ScheduleNext();
+}
+
+void ButtonPlayer::ScheduleNext()
+{
+	if(Index < Changes.size())
+		Chip->Scheduler().Schedule(this, Changes[Index].Cycles, 0);
+}
@@ -0,0 +1,144 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _BUTTON_LOG_H
+#define _BUTTON_LOG_H
+
+#include <QMutex>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include "TimerScheduler.h"
+
+class ATtiny;
+class HallKeypad;
+
+/* Button input recorded to a file and played back at the same times, to
+ * reproduce a game by its input or to run the same input against another
+ * build of the emulator.
+ *
+ * Each change is stamped with TimerScheduler::Now, the oscillator cycles
+ * since the chip was created.  With virtual time those are the emulated
+ * cycles and the replay is exact, with the wall clock it is
+ * CLOCK_MONOTONIC and the replay is as close as the timer thread wakes up.
+ *
+ * The file is "KPB" and a version byte, a flags byte (bit 0 recorded with
+ * virtual time), then for each change the cycles since the previous one as
+ * an unsigned LEB128 number and the buttons as 16 bits little endian.
+ *
+ * A scenario, see keypadalike-batch, can be played in place of a
+ * recording, its save and restore lines are skipped.
+ */
+namespace ButtonLog
+{
+	enum
+	{
+		Version=1,
+		// flags
+		VirtualTime=1
+	};
+}
+
+/* A script of button changes, saves and restores, read from a text file
+ * with a line for each, the time in seconds followed by the buttons in hex,
+ * "save path", "restore path", or "end", see batch.cc.  # starts a
+ * comment.
+ */
+struct Scenario
+{
+	struct Step
+	{
+		uint64_t Cycles;
+		enum
+		{
+			Press,
+			Save,
+			Restore
+		} Action;
+		uint16_t Buttons;
+		// the file to save, and the state read from the file to
+		// restore
+		std::string Path;
+		std::vector<uint8_t> State;
+	};
+	std::string Path;
+	std::vector<Step> Steps;
+	uint64_t End;
+};
+
+/* Read path into out, End is seconds unless the script has an end, false
+ * with a message if path or a file to restore can't be read.  The files to
+ * restore are only read if states is true.
+ */
+bool LoadScenario(const char *path, double seconds, Scenario *out,
+	bool states=true);
+
+// Writes the button changes of one chip.
+class ButtonRecorder
+{
+public:
+	ButtonRecorder(ATtiny *chip);
+	// closes the file
+	~ButtonRecorder();
+	// Create path, call after the chip's time source is selected.
+	bool Open(const char *path);
+	// Add a change if buttons differ from the last, from any thread.
+	void Record(uint16_t buttons);
+	// Write out the buffered changes and close the file.
+	void Close();
+private:
+	ATtiny *Chip;
+	QMutex Mutex;
+	FILE *File;
+	uint64_t Last;
+	uint16_t Buttons;
+};
+
+// Reads a recording and sets the buttons of keypad at the same times.
+class ButtonPlayer : public TimerScheduler::Client
+{
+public:
+	ButtonPlayer(ATtiny *chip, HallKeypad *keypad);
+	// Read the recording or scenario from path, false if it isn't one.
+	bool Load(const char *path);
+	// the end of a scenario, 0 for none
+	uint64_t GetEnd() const { return End; }
+	// Schedule the first change.
+	void Start();
+	virtual void Expire(uint32_t generation);
+private:
+	void ScheduleNext();
+	bool LoadScript(const char *path);
+	struct Change
+	{
+		uint64_t Cycles;
+		uint16_t Buttons;
+	};
+	ATtiny *Chip;
+	HallKeypad *Keypad;
+	std::vector<Change> Changes;
+	size_t Index;
+	uint64_t End;
+};
+
+#endif // _BUTTON_LOG_H
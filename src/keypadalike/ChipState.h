@@ -0,0 +1,76 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CHIP_STATE_H
+#define _CHIP_STATE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/* The saved state of a chip, see ATtiny::SaveState.  Each part of the
+ * chip appends its values with Put, and reads them back in the same order
+ * with Get.  A Get past the end returns zeros and sets Failed.
+ */
+class ChipState
+{
+public:
+	ChipState() : Offset(0), Bad(false) {}
+	explicit ChipState(const std::vector<uint8_t> &data) :
+		Data(data), Offset(0), Bad(false) {}
+
+	void Put(const void *value, size_t size)
+	{
+		const uint8_t *p=(const uint8_t*)value;
+		Data.insert(Data.end(), p, p+size);
+	}
+	template<class T> void Put(const T &value) { Put(&value, sizeof(value)); }
+
+	void Get(void *value, size_t size)
+	{
+		if(Bad || size > Data.size()-Offset)
+		{
+			Bad=true;
+			memset(value, 0, size);
+			return;
+		}
+		memcpy(value, &Data[Offset], size);
+		Offset+=size;
+	}
+	template<class T> T Get()
+	{
+		T value;
+		Get(&value, sizeof(value));
+		return value;
+	}
+	// A Get ran past the end.
+	bool Failed() const { return Bad; }
+	// Everything was read.
+	bool AtEnd() const { return Offset==Data.size(); }
+
+	std::vector<uint8_t> Data;
+private:
+	size_t Offset;
+	bool Bad;
+};
+
+#endif // _CHIP_STATE_H
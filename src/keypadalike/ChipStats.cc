@@ -0,0 +1,118 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ChipStats.h"
+#include <stdio.h>
+
+void PrintMissed(ATtiny &chip)
+{
+	TimerScheduler &scheduler=chip.Scheduler();
+	for(int i=0; i<TimerScheduler::MissPolicyCount; ++i)
+	{
+		TimerScheduler::MissPolicy policy=(TimerScheduler::MissPolicy)i;
+		if(uint32_t count=scheduler.GetMissed(policy))
+			printf("missed timer deadlines, %s %u\n",
+				TimerScheduler::MissPolicyName(policy), count);
+	}
+}
+
+void PrintInterruptStats(ATtiny &chip)
+{
+	InterruptController &irq=chip.Interrupts();
+	for(int i=0; i<InterruptController::VectorCount; ++i)
+	{
+		InterruptController::Vector vector=
+			(InterruptController::Vector)i;
+		InterruptController::Stats stats=irq.GetStats(vector);
+		if(!stats.Count && !stats.Coalesced)
+			continue;
+		double elapsed=VirtualClock::ToSeconds(stats.Last-stats.First);
+		double rate=elapsed > 0 ? (stats.Count-1)/elapsed : 0;
+		double latency=stats.Count ?
+			VirtualClock::ToSeconds(stats.LatencySum)/stats.Count : 0;
+		printf("%s count %llu rate %.2f Hz latency avg %.1f us "
+			"max %.1f us coalesced %llu\n",
+			InterruptController::Name(vector),
+			(unsigned long long)stats.Count, rate, latency*1e6,
+			VirtualClock::ToSeconds(stats.LatencyMax)*1e6,
+			(unsigned long long)stats.Coalesced);
+	}
+	ATtiny::SleepStats sleeps=chip.GetSleepStats();
+	if(sleeps.Count)
+		printf("sleeps %llu asleep %.3f s wakeup latency avg %.1f us "
+			"max %.1f us\n", (unsigned long long)sleeps.Count,
+			VirtualClock::ToSeconds(sleeps.Slept),
+			VirtualClock::ToSeconds(sleeps.LatencySum)/
+				sleeps.Count*1e6,
+			VirtualClock::ToSeconds(sleeps.LatencyMax)*1e6);
+	ToneOscillator::Stats tone=chip.GetToneStats();
+	if(tone.Started)
+		printf("tone oscillator started %llu toggles %llu "
+			"handler runs checked %llu\n",
+			(unsigned long long)tone.Started,
+			(unsigned long long)tone.Synthesized,
+			(unsigned long long)tone.Verified);
+	ATtiny::WakeStats wakes=chip.GetWakeStats();
+	printf("thread waits %llu wakeups %llu spurious %llu\n",
+		(unsigned long long)wakes.Waits,
+		(unsigned long long)wakes.Wakeups,
+		(unsigned long long)wakes.Spurious);
+	printf("baton handoffs %llu forced %llu\n",
+		(unsigned long long)wakes.Handoffs,
+		(unsigned long long)wakes.Forced);
+}
+
+void PrintInputStats(HallKeypad &keypad)
+{
+	HallKeypad::InputStats stats=keypad.GetInputStats();
+	if(!stats.Edges && !stats.Coalesced)
+		return;
+	printf("button edges %llu latency avg %.1f us max %.1f us "
+		"coalesced %llu\n", (unsigned long long)stats.Edges,
+		stats.Edges ? VirtualClock::ToSeconds(stats.LatencySum)/
+			stats.Edges*1e6 : 0,
+		VirtualClock::ToSeconds(stats.LatencyMax)*1e6,
+		(unsigned long long)stats.Coalesced);
+	for(int i=0; i<LatencyTrace::StageCount; ++i)
+	{
+		LatencyTrace::Stage stage=(LatencyTrace::Stage)i;
+		LatencyHistogram::Counts counts=keypad.Latency().Get(stage);
+		if(!counts.Count)
+			continue;
+		printf("host latency %s count %llu avg %.1f us max %.1f us\n",
+			LatencyTrace::Name(stage),
+			(unsigned long long)counts.Count,
+			counts.SumNs/1e3/counts.Count, counts.MaxNs/1e3);
+		for(int b=0; b<LatencyHistogram::Buckets; ++b)
+		{
+			if(!counts.Bucket[b])
+				continue;
+			if(b==LatencyHistogram::Buckets-1)
+				printf("\t>= %llu us", (unsigned long long)
+					LatencyHistogram::BucketLimitUs(b-1));
+			else
+				printf("\t< %llu us", (unsigned long long)
+					LatencyHistogram::BucketLimitUs(b));
+			printf(" %llu\n", (unsigned long long)counts.Bucket[b]);
+		}
+	}
+}
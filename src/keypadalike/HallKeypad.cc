@@ -21,69 +21,92 @@ hardware buttons and LEDs.
 */
 
 #include "HallKeypad.h"
+#include "ChipState.h"
+#include "TimerScheduler.h"
 #include <iostream>
 #include <QMutexLocker>
 
 using namespace std;
 
 HallKeypad::HallKeypad() :
-	Buttons(0xffff),
+	Overflow(0),
+	Coalesced(0),
+	Time(NULL),
+	MinHold(0),
+	Presented(0),
+	Unseen(0),
+	Seen(0),
+	Since(0),
 	LEDs(0),
-	PortD(0),
-	PortB(0)
+	SignaledLEDs(0),
+	Bus(NULL),
+	Screen(NULL),
+	Speaker(NULL)
 {
+	Stats.Edges=0;
+	Stats.Coalesced=0;
+	Stats.LatencySum=0;
+	Stats.LatencyMax=0;
 }
 
-void HallKeypad::SetPort(RegEnum reg, uint8_t value)
+void HallKeypad::Attach(PinBus *bus)
 {
-	QMutexLocker locker(&Mutex);
-	if(reg == REG_PORTD)
-	{
-		PortD=value;
-		UpdateLEDs();
+	Bus=bus;
+	Bus->Subscribe(this, PinBus::PortD, _BV(PD2) | _BV(PD3));
+	Bus->Subscribe(this, PinBus::PortB, 0xff);
+	if(Speaker)
+		Bus->Subscribe(Speaker, PinBus::PortD, _BV(PD1) | _BV(PD6));
+}
 
-		Audio.SetPins(value & _BV(PD1), value & _BV(PD6));
-		// inputs are read from GetPort so skip any buttons enable bits
-		return;
-	}
-	if(reg == REG_PORTB)
-	{
-		PortB=value;
-		UpdateLEDs();
-	}
-	//if(reg == REG_PORTA) TODO
+void HallKeypad::PinsChanged(PinBus::Port port, uint8_t value,
+	uint8_t changed)
+{
+	// A latch follows port B while enabled, it holds the value when
+	// the enable goes low.
+	uint8_t portd=Bus->Get(PinBus::PortD);
+	uint8_t portb=Bus->Get(PinBus::PortB);
+	if(portd & _BV(PD2))
+		LEDs = (LEDs &0xff00) | portb;
+	if(portd & _BV(PD3))
+		LEDs = (LEDs &0x00ff) | (portb<<8);
 }
 
-void HallKeypad::UpdateLEDs()
+void HallKeypad::PinsSettled()
 {
-	uint16_t output=LEDs;
-	if(PortD & _BV(PD2))
-		output = (output &0xff00) | PortB;
-	if(PortD & _BV(PD3))
-		output = (output &0x00ff) | (PortB<<8);
-	if(LEDs != output)
-	{
-		LEDs=output;
-		SetLEDs(~LEDs);
-	}
+	if(LEDs == SignaledLEDs)
+		return;
+	SignaledLEDs=LEDs;
+	Trace.LEDsChanged();
+	// the LEDs are active low
+	if(Screen)
+		Screen->ShowLEDs(~LEDs & 0x3ff);
 }
 
 uint8_t HallKeypad::GetPort(RegEnum reg)
 {
-	QMutexLocker locker(&Mutex);
+	uint8_t portd=Bus ? Bus->Get(PinBus::PortD) : 0;
 	if(reg == REG_PIND)
-		return PortD;
+		return portd;
 	if(reg != REG_PINB)
 		return 0xff & rand();
 	uint8_t value=0;
 	// button input "Output Enable" line is active low
-	uint8_t invD=~PortD;
+	uint8_t invD=~portd;
 	if(invD & (_BV(PD4) | _BV(PD5)))
 	{
+		// a second read through the same chip, the program's polling
+		// came around without reading the other one
+		if(Seen & invD & (_BV(PD4) | _BV(PD5)))
+			Unseen=0;
+		NextEdge(Time ? Time->Now() : 0);
+		// 0 for pressed, 1 for not pressed
+		uint16_t buttons=~Presented;
 		if(invD & _BV(PD4))
-			value=Buttons;
+			value=buttons;
 		if(invD & _BV(PD5))
-			value|=Buttons>>8;
+			value|=buttons>>8;
+		Unseen&=~invD;
+		Seen|=invD & (_BV(PD4) | _BV(PD5));
 	}
 	else
 	{
@@ -94,9 +117,80 @@ uint8_t HallKeypad::GetPort(RegEnum reg)
 	return value;
 }
 
-void HallKeypad::SetButtons(uint16_t buttons)
+void HallKeypad::NextEdge(uint64_t now)
+{
+	// without a time source there is no hold time
+	while(!Unseen && (!Time || now - Since >= MinHold))
+	{
+		Edge edge;
+		if(const Edge *front=Edges.Front())
+		{
+			edge=*front;
+			Edges.Pop();
+		}
+		else if(uint32_t overflow=Overflow.exchange(0))
+		{
+			// the time of a coalesced state isn't kept
+			edge.Stamp=now;
+			edge.Input=0;
+			edge.Buttons=overflow;
+		}
+		else
+		{
+			break;
+		}
+		uint16_t changed=Presented ^ edge.Buttons;
+		if(!changed)
+			continue;
+		Presented=edge.Buttons;
+		Since=now;
+		Seen=0;
+		Unseen=(changed & 0xff ? _BV(PD4) : 0) |
+			(changed & 0x300 ? _BV(PD5) : 0);
+		++Stats.Edges;
+		if(edge.Input)
+			Trace.EdgeRead(edge.Input);
+		uint64_t latency=now > edge.Stamp ? now - edge.Stamp : 0;
+		Stats.LatencySum+=latency;
+		if(latency > Stats.LatencyMax)
+			Stats.LatencyMax=latency;
+	}
+}
+
+void HallKeypad::SetButtons(uint16_t buttons, uint64_t input)
+{
+	QMutexLocker locker(&InputMutex);
+	Edge edge={Time ? Time->Now() : 0,
+		input ? input : LatencyTrace::Now(), buttons};
+	// once something overflowed the queue the following states have to
+	// go there too, to stay in order
+	if(!Overflow && Edges.Push(edge))
+		return;
+	Overflow=OverflowValid | buttons;
+	++Coalesced;
+}
+
+HallKeypad::InputStats HallKeypad::GetInputStats() const
+{
+	InputStats stats=Stats;
+	stats.Coalesced=Coalesced;
+	return stats;
+}
+
+void HallKeypad::SaveState(ChipState *state)
+{
+	// the edges still queued are input, not state
+	state->Put((uint16_t)~Presented);
+	state->Put(LEDs);
+}
+
+void HallKeypad::RestoreState(ChipState *state)
 {
-	QMutexLocker locker(&Mutex);
-	// 0 for pressed, 1 for not pressed, invert
-	Buttons=~buttons;
+	Presented=~state->Get<uint16_t>();
+	Unseen=0;
+	Seen=0;
+	Edges.Clear();
+	Overflow=0;
+	LEDs=state->Get<uint16_t>();
+	PinsSettled();
 }
@@ -23,49 +23,138 @@ hardware buttons and LEDs.
 #ifndef _HALL_KEYPAD_H
 #define _HALL_KEYPAD_H
 
-#include <QObject>
 #include <QMutex>
+#include <atomic>
 #include <avr/io.h>
-#include "SquareAudio.h"
+#include "PinBus.h"
+#include "SpscQueue.h"
+#include "LatencyTrace.h"
+
+class ChipState;
+class TimerScheduler;
 
 /* Emulates the Hall Research KP2B keypad connections to the microcontroller
- * registers.
+ * registers.  The LED latches subscribe to the bus pins PD2, PD3 and port B,
+ * the speaker to PD1 and PD6.
+ *
+ * It only depends on QtCore, the LEDs are reported to a Display and the
+ * buttons set with SetButtons, see KeypadLink for the GUI.
+ *
+ * Each SetButtons is queued as an edge with its time, and a read of port B
+ * moves to the next edge only after the one it shows has been read through
+ * each input chip (U4 buttons 0-7, U2 8-9) whose buttons it changed, or
+ * one chip was read twice (the program doesn't read the other), and held
+ * for the minimum hold time.  A tap shorter than the program's polling is
+ * then still seen, only later.  The queue is lock-free from
+ * the input thread to the program's thread, when it is full the newest
+ * state replaces whatever didn't fit (coalesced).
  */
-class HallKeypad : public QObject
+class HallKeypad : public PinBus::Subscriber
 {
-	Q_OBJECT
 public:
+	// Receives the LED frames.
+	class Display
+	{
+	public:
+		virtual ~Display() {}
+		/* Called from the program's thread with the ATtiny lock
+		 * held when the LEDs change, a set bit is an LED that is
+		 * on, in the same order as the buttons.
+		 */
+		virtual void ShowLEDs(uint16_t led) = 0;
+	};
+	// see GetInputStats
+	struct InputStats
+	{
+		// button edges the program read
+		uint64_t Edges;
+		// SetButtons calls that didn't fit in the queue
+		uint64_t Coalesced;
+		// cycles from SetButtons to the first read of the edge
+		uint64_t LatencySum;
+		uint64_t LatencyMax;
+	};
 	HallKeypad();
-	// Only call with registers connected to output ports when the
-	// direction is out.  Input pullup resistors aren't delt with right
-	// now, so if the direction is input the bit will always be 0.
-	void SetPort(RegEnum reg, uint8_t value);
+	// Set the display and the speaker (given PD1 and PD6), both are
+	// optional, call before Attach.
+	void SetDisplay(Display *display) { Screen=display; }
+	void SetSpeaker(PinBus::Subscriber *speaker) { Speaker=speaker; }
+	// Connect to the output ports, call before the program runs.
+	void Attach(PinBus *bus);
+	// The time the edges are stamped and held with, optional.
+	void SetTimeSource(TimerScheduler *time) { Time=time; }
+	// Oscillator cycles each edge is shown for at least, 0 by default.
+	void SetMinHold(uint64_t cycles) { MinHold=cycles; }
 	// Call to read from a port that is in input direction.
 	uint8_t GetPort(RegEnum reg);
-public slots:
+	// LED latches, only the end result of a write is signaled.
+	virtual void PinsChanged(PinBus::Port port, uint8_t value,
+		uint8_t changed);
+	virtual void PinsSettled();
 	// like the hardware bit 0 to 9 is, 0 top left to top right,
-	// then bottom left to bottom right
-	void SetButtons(uint16_t buttons);
-signals:
-	void SetLEDs(uint16_t led);
-private:
-	/* Sets LEDs from PortD enable bits and the current PortB values,
-	 * if it changed signal SetLEDs
+	// then bottom left to bottom right, set for pressed, can be called
+	// from any thread, input is the LatencyTrace::Now time the change
+	// was first seen, 0 for now
+	void SetButtons(uint16_t buttons, uint64_t input=0);
+	InputStats GetInputStats() const;
+	// the host time of the stages from the input to the LEDs
+	LatencyTrace& Latency() { return Trace; }
+	/* Append the buttons and the LED latches to state, RestoreState
+	 * reads them back and shows the LEDs, see ATtiny::SaveState.
 	 */
-	void UpdateLEDs();
-	QMutex Mutex;
-	uint16_t Buttons, LEDs;
-	// True if that chip is enabled to pass the bus bits (port B) to
-	// drive the LEDs or to output the buttons to the bus.
+	void SaveState(ChipState *state);
+	void RestoreState(ChipState *state);
+private:
+	struct Edge
+	{
+		uint64_t Stamp;
+		// LatencyTrace time
+		uint64_t Input;
+		uint16_t Buttons;
+	};
+	enum
+	{
+		QueueSize=64,
+		// in Overflow with the buttons
+		OverflowValid=0x10000
+	};
+	// Show the next edge if the current one was read and held.
+	void NextEdge(uint64_t now);
+
+	// Serializes the SetButtons callers, normally only the input
+	// thread, so the queue has a single producer.  The program's
+	// thread never takes it.
+	QMutex InputMutex;
+	SpscQueue<Edge, QueueSize> Edges;
+	// the newest buttons that didn't fit in Edges, with OverflowValid
+	std::atomic<uint32_t> Overflow;
+	std::atomic<uint64_t> Coalesced;
+	TimerScheduler *Time;
+	uint64_t MinHold;
+
+	// The rest is only accessed with the ATtiny lock held.
+	// buttons shown to the program, set for pressed
+	uint16_t Presented;
+	// input chip enables (PD4, PD5) that haven't read Presented yet,
+	// and that have
+	uint8_t Unseen, Seen;
+	// when Presented was first read
+	uint64_t Since;
+	InputStats Stats;
+	LatencyTrace Trace;
+	uint16_t LEDs;
+	// LEDs last signaled
+	uint16_t SignaledLEDs;
+	// Port D enables if that chip is enabled to pass the bus bits
+	// (port B) to drive the LEDs or to output the buttons to the bus.
 	// U5LED driven by PD2 LED 0-7
 	// U3LED driven by PD3 LED 8-9
 	// U4Input driven active low by PD4 0-7
 	// U2Input driven active low by PD5 8-9
-	uint8_t PortD;
-	// data bus bits
-	uint8_t PortB;
+	PinBus *Bus;
 
-	SquareAudio Audio;
+	Display *Screen;
+	PinBus::Subscriber *Speaker;
 };
 
 #endif // _HALL_KEYPAD_H
@@ -0,0 +1,241 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "InterruptController.h"
+#include "ATtiny.h"
+#include <dlfcn.h>
+
+static thread_local int HandlerDepth;
+static thread_local InterruptController::Vector HandlerVector=
+	InterruptController::VectorReset;
+
+// Counts a handler running on this thread, including when ATtiny::Stop
+// unwinds out of it.
+struct HandlerScope
+{
+	HandlerScope(InterruptController::Vector vector) :
+		Outer(HandlerVector)
+	{
+		++HandlerDepth;
+		HandlerVector=vector;
+	}
+	~HandlerScope()
+	{
+		--HandlerDepth;
+		HandlerVector=Outer;
+	}
+	InterruptController::Vector Outer;
+};
+
+const uint32_t InterruptController::TimerVectors=
+	InterruptController::FromTimerBits(0xff);
+
+InterruptController::InterruptController(ATtiny *chip,
+	TimerScheduler *scheduler) :
+	Chip(chip),
+	Scheduler(scheduler),
+	Image(RTLD_DEFAULT),
+	Pending(0),
+	Enabled(0),
+	Resolved(0)
+{
+	for(int i=0; i<VectorCount; ++i)
+	{
+		Handlers[i]=NULL;
+		Counters &c=Counts[i];
+		c.Count=0;
+		c.Coalesced=0;
+		c.LatencySum=0;
+		c.LatencyMax=0;
+		c.First=0;
+		c.Last=0;
+		c.Raised=0;
+	}
+}
+
+void InterruptController::Raise(Vector vector)
+{
+	uint32_t bit=Bit(vector);
+	Counters &c=Counts[vector];
+	// set the time before the flag, Dispatch can run it right away
+	if(Pending & bit)
+	{
+		++c.Coalesced;
+		return;
+	}
+	c.Raised=Scheduler->Now();
+	if(Pending.fetch_or(bit) & bit)
+		++c.Coalesced;
+}
+
+void InterruptController::SetEnabled(uint32_t mask, uint32_t enable)
+{
+	// Only called with the ATtiny lock held, which covers Resolved.
+	enable&=mask;
+	for(int i=0; i<VectorCount; ++i)
+	{
+		uint32_t bit=Bit((Vector)i);
+		if(!(enable & bit) || (Resolved & bit))
+			continue;
+		Resolved|=bit;
+		/* Note dlsym can only find symbols in shared objects,
+		 * if the function is compiled into the executable it
+		 * will not find it.
+		 */
+		Handlers[i]=(Handler)dlsym(Image, Name((Vector)i));
+	}
+	uint32_t handled=0;
+	for(int i=0; i<VectorCount; ++i)
+	{
+		if(Handlers[i])
+			handled|=Bit((Vector)i);
+	}
+	uint32_t enabled=Enabled;
+	Enabled=(enabled & ~mask) | (enable & handled);
+}
+
+bool InterruptController::Dispatch()
+{
+	for(;;)
+	{
+		if(!(Pending & Enabled))
+			return false;
+		if(!Chip->IntTryStart())
+			return true;
+		// Another thread could have run it before interrupts were
+		// disabled here.
+		uint32_t ready=Pending & Enabled;
+		if(!ready)
+		{
+			Chip->IntStop();
+			return false;
+		}
+		Vector vector=(Vector)__builtin_ctz(ready);
+		uint32_t bit=Bit(vector);
+		// the flag is cleared when the vector executes
+		Pending&=~bit;
+
+		Counters &c=Counts[vector];
+		uint64_t now=Scheduler->Now();
+		uint64_t raised=c.Raised;
+		uint64_t latency=now > raised ? now-raised : 0;
+		if(!c.Count++)
+			c.First=now;
+		c.Last=now;
+		c.LatencySum+=latency;
+		uint64_t max=c.LatencyMax;
+		while(latency > max &&
+			!c.LatencyMax.compare_exchange_weak(max, latency))
+			;
+
+		Chip->HandlerStart(vector);
+		{
+			HandlerScope scope(vector);
+			Handlers[vector].load()();
+		}
+		Chip->IntStop(vector);
+	}
+}
+
+bool InterruptController::InHandler()
+{
+	return HandlerDepth;
+}
+
+InterruptController::Vector InterruptController::Current()
+{
+	return HandlerVector;
+}
+
+uint32_t InterruptController::FromTimerBits(uint8_t bits)
+{
+	static const Vector vectors[8]=
+	{
+		VectorTimer0CompA, // OCF0A
+		VectorTimer0Ovf, // TOV0
+		VectorTimer0CompB, // OCF0B
+		VectorTimer1Capt, // ICF1
+		VectorReset, // unused
+		VectorTimer1CompB, // OCF1B
+		VectorTimer1CompA, // OCF1A
+		VectorTimer1Ovf // TOV1
+	};
+	uint32_t mask=0;
+	for(int i=0; i<8; ++i)
+	{
+		if((bits & _BV(i)) && vectors[i]!=VectorReset)
+			mask|=Bit(vectors[i]);
+	}
+	return mask;
+}
+
+uint8_t InterruptController::ToTimerBits(uint32_t vectors)
+{
+	uint8_t bits=0;
+	for(int i=0; i<8; ++i)
+	{
+		if(FromTimerBits(_BV(i)) & vectors)
+			bits|=_BV(i);
+	}
+	return bits;
+}
+
+InterruptController::Stats InterruptController::GetStats(Vector vector) const
+{
+	const Counters &c=Counts[vector];
+	Stats stats;
+	stats.Count=c.Count;
+	stats.Coalesced=c.Coalesced;
+	stats.LatencySum=c.LatencySum;
+	stats.LatencyMax=c.LatencyMax;
+	stats.First=c.First;
+	stats.Last=c.Last;
+	return stats;
+}
+
+const char *InterruptController::Name(Vector vector)
+{
+	// the handler names the program defines with ISR()
+	static const char *names[VectorCount]=
+	{
+		"RESET_vect",
+		"INT0_vect",
+		"INT1_vect",
+		"TIMER1_CAPT_vect",
+		"TIMER1_COMPA_vect",
+		"TIMER1_OVF_vect",
+		"TIMER0_OVF_vect",
+		"USART_RX_vect",
+		"USART_UDRE_vect",
+		"USART_TX_vect",
+		"ANA_COMP_vect",
+		"PCINT_vect",
+		"TIMER1_COMPB_vect",
+		"TIMER0_COMPA_vect",
+		"TIMER0_COMPB_vect",
+		"USI_START_vect",
+		"USI_OVERFLOW_vect",
+		"EEPROM_READY_vect",
+		"WDT_OVERFLOW_vect"
+	};
+	return names[vector];
+}
@@ -0,0 +1,144 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INTERRUPT_CONTROLLER_H
+#define _INTERRUPT_CONTROLLER_H
+
+#include <atomic>
+#include <stdint.h>
+
+class ATtiny;
+class TimerScheduler;
+
+/* Holds the interrupt flags and runs the interrupt handlers.  A peripheral
+ * raises the flag for its vector, the flag stays pending until the
+ * handler runs or the program clears it, and raising it again in the
+ * meantime is coalesced into the one flag like the hardware.  Dispatch
+ * runs the pending vectors that are enabled, lowest vector number first,
+ * as long as interrupts are enabled.  It is called after a flag is
+ * raised and whenever the program enables interrupts, so a handler
+ * deferred by cli runs at the sei.
+ *
+ * The flags are an atomic bitmask, raising and clearing them doesn't
+ * take any lock.
+ */
+class InterruptController
+{
+public:
+	// ATtiny2313 interrupt vector numbers, lower has priority
+	enum Vector
+	{
+		VectorReset,
+		VectorInt0,
+		VectorInt1,
+		VectorTimer1Capt,
+		VectorTimer1CompA,
+		VectorTimer1Ovf,
+		VectorTimer0Ovf,
+		VectorUsartRx,
+		VectorUsartUdre,
+		VectorUsartTx,
+		VectorAnaComp,
+		VectorPcint,
+		VectorTimer1CompB,
+		VectorTimer0CompA,
+		VectorTimer0CompB,
+		VectorUsiStart,
+		VectorUsiOverflow,
+		VectorEepromReady,
+		VectorWdtOverflow,
+		VectorCount
+	};
+	// per vector counts, times are in oscillator cycles
+	struct Stats
+	{
+		// handler runs
+		uint64_t Count;
+		// raised again while it was still pending
+		uint64_t Coalesced;
+		// from the flag being raised to the handler starting
+		uint64_t LatencySum;
+		uint64_t LatencyMax;
+		// time of the first and last handler run
+		uint64_t First;
+		uint64_t Last;
+	};
+	// chip runs the handlers, scheduler provides the time
+	InterruptController(ATtiny *chip, TimerScheduler *scheduler);
+	// The loaded program the handlers are looked up in.
+	void SetImage(void *image) { Image=image; }
+
+	static uint32_t Bit(Vector vector) { return 1u<<vector; }
+	// Set the flag for vector.
+	void Raise(Vector vector);
+	// Clear the flags in mask without running them.
+	void Clear(uint32_t mask) { Pending&=~mask; }
+	uint32_t GetPending() const { return Pending; }
+	// Replace all the flags, restoring a saved chip.
+	void SetPending(uint32_t pending) { Pending=pending; }
+	/* The vectors in mask are enabled if they are also in enable, the
+	 * handlers are looked up in the program the first time.
+	 */
+	void SetEnabled(uint32_t mask, uint32_t enable);
+	/* Run the enabled pending handlers until there are none or
+	 * interrupts are disabled, returns true if any are still pending.
+	 */
+	bool Dispatch();
+	// True if the calling thread is running an interrupt handler.
+	static bool InHandler();
+	// The handler the calling thread is running, VectorReset for none.
+	static Vector Current();
+
+	// TIFR and TIMSK have the same bit for each timer vector.
+	static uint32_t FromTimerBits(uint8_t bits);
+	static uint8_t ToTimerBits(uint32_t vectors);
+	static const uint32_t TimerVectors;
+
+	Stats GetStats(Vector vector) const;
+	static const char *Name(Vector vector);
+private:
+	typedef void (*Handler)();
+	struct Counters
+	{
+		std::atomic<uint64_t> Count;
+		std::atomic<uint64_t> Coalesced;
+		std::atomic<uint64_t> LatencySum;
+		std::atomic<uint64_t> LatencyMax;
+		std::atomic<uint64_t> First;
+		std::atomic<uint64_t> Last;
+		// when the flag was raised
+		std::atomic<uint64_t> Raised;
+	};
+	ATtiny *Chip;
+	TimerScheduler *Scheduler;
+	// dlopen handle of the program
+	void *Image;
+	std::atomic<uint32_t> Pending;
+	// enabled and has a handler
+	std::atomic<uint32_t> Enabled;
+	// vectors looked up in the program
+	uint32_t Resolved;
+	std::atomic<Handler> Handlers[VectorCount];
+	Counters Counts[VectorCount];
+};
+
+#endif // _INTERRUPT_CONTROLLER_H
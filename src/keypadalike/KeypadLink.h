@@ -0,0 +1,76 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _KEYPAD_LINK_H
+#define _KEYPAD_LINK_H
+
+#include <QObject>
+#include <QTimer>
+#include <stdint.h>
+#include "HallKeypad.h"
+#include "ButtonLog.h"
+#include "LEDMailbox.h"
+#include "TimerScheduler.h"
+
+/* Connects a HallKeypad to the GUI with signals and slots.  The LED frames
+ * come from the program's thread into a LEDMailbox stamped with the chip's
+ * time, the GUI thread polls it once a display frame, the one tick every
+ * LED is repainted from, and signals SetLEDs if anything changed.
+ */
+class KeypadLink : public QObject, public HallKeypad::Display
+{
+	Q_OBJECT
+public:
+	enum
+	{
+		// display frame, milliseconds
+		FrameMs=16
+	};
+	// Becomes the display of keypad, time is the chip's.
+	KeypadLink(HallKeypad *keypad, TimerScheduler *time);
+	virtual void ShowLEDs(uint16_t led)
+	{
+		Mailbox.Post(led, Time->Now());
+	}
+	// Also give the buttons to recorder, optional.
+	void SetRecorder(ButtonRecorder *recorder) { Recorder=recorder; }
+public slots:
+	void SetButtons(uint16_t buttons, quint64 input)
+	{
+		if(Recorder)
+			Recorder->Record(buttons);
+		Keypad->SetButtons(buttons, input);
+	}
+signals:
+	// the LEDs and their intensity since the last frame
+	void SetLEDs(const LEDMailbox::Frame &frame);
+private slots:
+	void Poll();
+private:
+	HallKeypad *Keypad;
+	ButtonRecorder *Recorder;
+	TimerScheduler *Time;
+	LEDMailbox Mailbox;
+	QTimer FrameTimer;
+};
+
+#endif // _KEYPAD_LINK_H
@@ -0,0 +1,103 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "LEDMailbox.h"
+
+LEDMailbox::LEDMailbox() :
+	Sequence(0),
+	Latest(0),
+	Changed(0),
+	TakenAt(0)
+{
+	Last.LEDs=0;
+	for(int i=0; i<LEDCount; ++i)
+	{
+		OnCycles[i]=0;
+		TakenOn[i]=0;
+		Last.Intensity[i]=0;
+	}
+}
+
+void LEDMailbox::Post(uint16_t led, uint64_t now)
+{
+	uint32_t seq=Sequence.load(std::memory_order_relaxed);
+	Sequence.store(seq+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	uint16_t was=Latest.load(std::memory_order_relaxed);
+	uint64_t changed=Changed.load(std::memory_order_relaxed);
+	if(now > changed)
+	{
+		for(int i=0; i<LEDCount; ++i)
+			if(was & 1<<i)
+				OnCycles[i].store(OnCycles[i].load(
+					std::memory_order_relaxed)+now-changed,
+					std::memory_order_relaxed);
+		Changed.store(now, std::memory_order_relaxed);
+	}
+	Latest.store(led, std::memory_order_relaxed);
+
+	Sequence.store(seq+2, std::memory_order_release);
+}
+
+bool LEDMailbox::Take(uint64_t now, Frame *frame)
+{
+	uint16_t led;
+	uint64_t changed;
+	uint64_t on[LEDCount];
+	for(;;)
+	{
+		uint32_t seq=Sequence.load(std::memory_order_acquire);
+		if(seq & 1)
+			continue;
+		led=Latest.load(std::memory_order_relaxed);
+		changed=Changed.load(std::memory_order_relaxed);
+		for(int i=0; i<LEDCount; ++i)
+			on[i]=OnCycles[i].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(seq == Sequence.load(std::memory_order_relaxed))
+			break;
+	}
+	// now can be read before a Post that came after it
+	if(now < changed)
+		now=changed;
+	frame->LEDs=led;
+	uint64_t elapsed=now > TakenAt ? now - TakenAt : 0;
+	for(int i=0; i<LEDCount; ++i)
+	{
+		// the time since the last change counts for an LED still on
+		if(led & 1<<i)
+			on[i]+=now - changed;
+		if(!elapsed)
+			frame->Intensity[i]=led & 1<<i ? 255 : 0;
+		else
+			frame->Intensity[i]=(on[i]-TakenOn[i]) >= elapsed ?
+				255 : (on[i]-TakenOn[i])*255/elapsed;
+		TakenOn[i]=on[i];
+	}
+	TakenAt=now;
+	bool same=frame->LEDs == Last.LEDs;
+	for(int i=0; same && i<LEDCount; ++i)
+		same=frame->Intensity[i] == Last.Intensity[i];
+	Last=*frame;
+	return !same;
+}
@@ -0,0 +1,81 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LED_MAILBOX_H
+#define _LED_MAILBOX_H
+
+#include <atomic>
+#include <stdint.h>
+
+/* The latest LED state from the program's thread to the GUI, in place of a
+ * queued signal for every change, which grows the GUI's event queue
+ * without bound when a program multiplexes or dims the LEDs at kHz rates.
+ * Neither side takes a lock and the memory used doesn't depend on the
+ * rate.
+ *
+ * Post is given the time of each change and adds up how long each LED has
+ * been on.  Once a frame the GUI takes the LEDs with the fraction of the
+ * time since the last frame each was on, so an LED dimmed by switching it
+ * on and off is shown by its duty cycle, not by how often it switched.
+ * The times are TimerScheduler::Now cycles, with virtual time a frame
+ * covers however much emulated time passed.
+ *
+ * The values Post writes together are read with a sequence count, Take
+ * reads them again if a Post was writing at the same time.
+ */
+class LEDMailbox
+{
+public:
+	enum
+	{
+		LEDCount=10
+	};
+	struct Frame
+	{
+		// set for on, the same order as the buttons
+		uint16_t LEDs;
+		// 0 for off the whole frame to 255 for on
+		uint8_t Intensity[LEDCount];
+	};
+	LEDMailbox();
+	// Producer, the LEDs changed to led at now.
+	void Post(uint16_t led, uint64_t now);
+	/* Consumer, fill frame for the time since the last Take up to now,
+	 * returns false if it is the same as the last frame.
+	 */
+	bool Take(uint64_t now, Frame *frame);
+private:
+	// odd while Post is writing
+	std::atomic<uint32_t> Sequence;
+	std::atomic<uint16_t> Latest;
+	// the time of the last Post
+	std::atomic<uint64_t> Changed;
+	// cycles each LED was on up to Changed
+	std::atomic<uint64_t> OnCycles[LEDCount];
+
+	// consumer, the last Take
+	uint64_t TakenAt;
+	uint64_t TakenOn[LEDCount];
+	Frame Last;
+};
+
+#endif // _LED_MAILBOX_H
@@ -0,0 +1,86 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "LEDPanel.h"
+#include "LatencyTrace.h"
+#include <QPainter>
+#include <algorithm>
+
+LEDPanel::LEDPanel(QWidget *parent) :
+	QWidget(parent),
+	Diameter(0),
+	Trace(NULL)
+{
+	for(int i=0; i<LEDMailbox::LEDCount; ++i)
+		Level[i]=0;
+	setMinimumSize(20*Columns, 20*Rows);
+}
+
+void LEDPanel::SetLEDs(const LEDMailbox::Frame &frame)
+{
+	bool changed=false;
+	for(int i=0; i<LEDMailbox::LEDCount; ++i)
+	{
+		unsigned char level=frame.Intensity[i]*(Levels-1)/255;
+		if(level == Level[i])
+			continue;
+		Level[i]=level;
+		changed=true;
+	}
+	if(changed)
+		update();
+}
+
+void LEDPanel::resizeEvent(QResizeEvent *event)
+{
+	Diameter=std::min(width()/Columns, height()/Rows) *3/4;
+	for(int i=0; i<Levels; ++i)
+		Cache[i]=QPixmap();
+}
+
+const QPixmap& LEDPanel::Pixmap(int level)
+{
+	QPixmap &pixmap=Cache[level];
+	if(pixmap.isNull())
+	{
+		pixmap=QPixmap(Diameter, Diameter);
+		pixmap.fill(Qt::transparent);
+		QPainter painter(&pixmap);
+		painter.setBrush(QColor(level*255/(Levels-1), 0, 0));
+		painter.drawEllipse(0, 0, Diameter-1, Diameter-1);
+	}
+	return pixmap;
+}
+
+void LEDPanel::paintEvent(QPaintEvent *event)
+{
+	if(Diameter <= 0)
+		return;
+	QPainter painter(this);
+	int w=width()/Columns, h=height()/Rows;
+	// centered in each cell
+	for(int i=0; i<LEDMailbox::LEDCount; ++i)
+		painter.drawPixmap(i%Columns*w + (w-Diameter)/2,
+			i/Columns*h + (h-Diameter)/2, Pixmap(Level[i]));
+	if(Trace)
+		Trace->Painted();
+}
@@ -0,0 +1,64 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LED_PANEL_H
+#define _LED_PANEL_H
+
+#include <QWidget>
+#include <QPixmap>
+#include "LEDMailbox.h"
+
+class LatencyTrace;
+
+/* The ten LEDs of the keypad in two rows of five, in one widget painted
+ * from a pixmap for each brightness level, made the first time the level
+ * is shown at the current size.  It is repainted only when a frame
+ * changes the level of an LED.
+ */
+class LEDPanel : public QWidget
+{
+public:
+	enum
+	{
+		Columns=5,
+		Rows=2,
+		Levels=32
+	};
+	LEDPanel(QWidget *parent=NULL);
+	// Show the LED intensities of frame.
+	void SetLEDs(const LEDMailbox::Frame &frame);
+	// Report each paint to trace, optional.
+	void SetLatencyTrace(LatencyTrace *trace) { Trace=trace; }
+protected:
+	void paintEvent(QPaintEvent *event);
+	void resizeEvent(QResizeEvent *event);
+private:
+	// the pixmap of level at Diameter
+	const QPixmap& Pixmap(int level);
+	unsigned char Level[LEDMailbox::LEDCount];
+	// null until used at this size
+	QPixmap Cache[Levels];
+	int Diameter;
+	LatencyTrace *Trace;
+};
+
+#endif // _LED_PANEL_H
@@ -0,0 +1,112 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "LatencyTrace.h"
+#include <time.h>
+
+LatencyHistogram::LatencyHistogram() :
+	Count(0),
+	SumNs(0),
+	MaxNs(0)
+{
+	for(int i=0; i<Buckets; ++i)
+		Bucket[i]=0;
+}
+
+void LatencyHistogram::Add(uint64_t ns)
+{
+	uint64_t us=ns/1000;
+	int bucket=0;
+	while(us && bucket < Buckets-1)
+	{
+		us>>=1;
+		++bucket;
+	}
+	Bucket[bucket].fetch_add(1, std::memory_order_relaxed);
+	SumNs.fetch_add(ns, std::memory_order_relaxed);
+	if(ns > MaxNs.load(std::memory_order_relaxed))
+		MaxNs.store(ns, std::memory_order_relaxed);
+	Count.fetch_add(1, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Counts LatencyHistogram::Get() const
+{
+	Counts counts;
+	counts.Count=Count;
+	counts.SumNs=SumNs;
+	counts.MaxNs=MaxNs;
+	for(int i=0; i<Buckets; ++i)
+		counts.Bucket[i]=Bucket[i];
+	return counts;
+}
+
+LatencyTrace::LatencyTrace() :
+	ReadInput(0),
+	ReadAt(0),
+	ChangedInput(0),
+	Changed(0)
+{
+}
+
+uint64_t LatencyTrace::Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+const char* LatencyTrace::Name(Stage stage)
+{
+	static const char *names[StageCount]={"read", "led", "paint",
+		"total"};
+	return names[stage];
+}
+
+void LatencyTrace::EdgeRead(uint64_t input)
+{
+	uint64_t now=Now();
+	Stages[Read].Add(now > input ? now - input : 0);
+	ReadInput=input;
+	ReadAt=now;
+}
+
+void LatencyTrace::LEDsChanged()
+{
+	if(!ReadAt)
+		return;
+	uint64_t now=Now();
+	Stages[LED].Add(now - ReadAt);
+	ChangedInput.store(ReadInput, std::memory_order_relaxed);
+	Changed.store(now, std::memory_order_release);
+	ReadAt=0;
+}
+
+void LatencyTrace::Painted()
+{
+	uint64_t changed=Changed.exchange(0, std::memory_order_acquire);
+	if(!changed)
+		return;
+	uint64_t input=ChangedInput.load(std::memory_order_relaxed);
+	uint64_t now=Now();
+	Stages[Paint].Add(now - changed);
+	Stages[Total].Add(now - input);
+}
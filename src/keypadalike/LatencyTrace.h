@@ -0,0 +1,106 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LATENCY_TRACE_H
+#define _LATENCY_TRACE_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Counts latencies in power of two buckets of microseconds.
+class LatencyHistogram
+{
+public:
+	enum
+	{
+		// the last one counts everything from about 4 s up
+		Buckets=24
+	};
+	// a copy of the counts
+	struct Counts
+	{
+		uint64_t Count;
+		uint64_t SumNs;
+		uint64_t MaxNs;
+		uint64_t Bucket[Buckets];
+	};
+	LatencyHistogram();
+	// from one thread at a time
+	void Add(uint64_t ns);
+	// from any thread
+	Counts Get() const;
+	/* Bucket 0 counts latencies under 1 us, bucket i (but the last)
+	 * from BucketLimitUs(i-1) to under BucketLimitUs(i).
+	 */
+	static uint64_t BucketLimitUs(int bucket) { return 1ull << bucket; }
+private:
+	std::atomic<uint64_t> Count, SumNs, MaxNs;
+	std::atomic<uint64_t> Bucket[Buckets];
+};
+
+/* Follows button edges from the input to the screen with the host's
+ * CLOCK_MONOTONIC time (not the emulated time), and keeps a histogram for
+ * each stage.
+ *	Read, the input (SoftIO, or HallKeypad::SetButtons) to the program's
+ *	first read of the edge, see HallKeypad::GetPort
+ *	LED, that read to the program's next change of the LEDs
+ *	Paint, the LED change to the next LEDPanel paint
+ *	Total, the input to that paint
+ * Only the last edge read is followed to an LED change, and only the last
+ * LED change to a paint.  Without the GUI nothing is painted.
+ */
+class LatencyTrace
+{
+public:
+	enum Stage
+	{
+		Read,
+		LED,
+		Paint,
+		Total,
+		StageCount
+	};
+	LatencyTrace();
+	// CLOCK_MONOTONIC in nanoseconds
+	static uint64_t Now();
+	static const char *Name(Stage stage);
+	// The program's thread read an edge that came in at input.
+	void EdgeRead(uint64_t input);
+	// The program's thread changed the LEDs.
+	void LEDsChanged();
+	// The GUI painted an LED.
+	void Painted();
+	// the histogram of stage, from any thread
+	LatencyHistogram::Counts Get(Stage stage) const
+	{
+		return Stages[stage].Get();
+	}
+private:
+	LatencyHistogram Stages[StageCount];
+	// program's thread, the last edge read not yet followed by an LED
+	// change, ReadAt is 0 without one
+	uint64_t ReadInput, ReadAt;
+	// the LED change not yet painted, Changed is 0 without one
+	std::atomic<uint64_t> ChangedInput, Changed;
+};
+
+#endif // _LATENCY_TRACE_H
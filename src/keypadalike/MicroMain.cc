@@ -23,15 +23,7 @@ hardware buttons and LEDs.
 #include "MicroMain.h"
 #include "ATtiny.h"
 
-// The avr's main is renamed avr_main.
-int avr_main();
-
 int MicroMain::Run()
 {
-	ATtiny::SetThreadAffinity();
-	g_ATtiny.RegisterMainThread();
-	g_ATtiny.MainStart();
-	int ret = avr_main();
-	g_ATtiny.MainStop();
-	return ret;
+	return Chip->Run();
 }
@@ -25,16 +25,23 @@ hardware buttons and LEDs.
 
 #include <QObject>
 
+class ATtiny;
+
 /* This class runs the microprocessor "main" function.  Call the Run slot
  * from its own thread.
  */
 class MicroMain: public QObject
 {
 	Q_OBJECT
+public:
+	// chip has the program loaded
+	MicroMain(ATtiny *chip) : Chip(chip) {}
 public slots:
 	// Run from the QThread, will not return as long as the program is
 	// executing.
 	int Run();
+private:
+	ATtiny *Chip;
 };
 
 #endif // _MICRO_MAIN_H
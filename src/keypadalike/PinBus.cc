@@ -0,0 +1,109 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "PinBus.h"
+#include <stdio.h>
+
+PinBus::PinBus()
+{
+	for(int i=0; i<PortCount; ++i)
+	{
+		Value[i]=0;
+		Toggling[i]=0;
+		SubCount[i]=0;
+	}
+}
+
+void PinBus::Subscribe(Subscriber *sub, Port port, uint8_t mask)
+{
+	if(SubCount[port] == MaxSubscribers)
+	{
+		fprintf(stderr, "PinBus too many subscribers for port %d\n",
+			port);
+		return;
+	}
+	Subscription &s=Subs[port][SubCount[port]++];
+	s.Sub=sub;
+	s.Mask=mask;
+}
+
+void PinBus::Write(const PortWrite *writes, size_t count)
+{
+	// subscribers that were called, for PinsSettled
+	Subscriber *called[PortCount*MaxSubscribers];
+	int called_count=0;
+	for(size_t i=0; i<count; ++i)
+	{
+		Port port=FromReg(writes[i].Reg);
+		if(port == PortCount)
+			continue;
+		uint8_t changed=(Value[port] ^ writes[i].Value) &
+			~Toggling[port];
+		Value[port]=writes[i].Value;
+		if(!changed)
+			continue;
+		for(int j=0; j<SubCount[port]; ++j)
+		{
+			const Subscription &s=Subs[port][j];
+			if(!(s.Mask & changed))
+				continue;
+			s.Sub->PinsChanged(port, Value[port], s.Mask & changed);
+			int k=0;
+			while(k<called_count && called[k]!=s.Sub)
+				++k;
+			if(k==called_count)
+				called[called_count++]=s.Sub;
+		}
+	}
+	for(int k=0; k<called_count; ++k)
+		called[k]->PinsSettled();
+}
+
+void PinBus::Toggle(Port port, uint8_t mask, uint64_t start, uint64_t half)
+{
+	uint8_t stopped=Toggling[port] & ~mask;
+	Toggling[port]=mask;
+	for(int j=0; j<SubCount[port]; ++j)
+	{
+		const Subscription &s=Subs[port][j];
+		if(s.Mask & mask)
+			s.Sub->PinsToggling(port, Value[port], s.Mask & mask,
+				start, half);
+		else if(s.Mask & stopped)
+			s.Sub->PinsChanged(port, Value[port], s.Mask & stopped);
+	}
+}
+
+PinBus::Port PinBus::FromReg(RegEnum reg)
+{
+	switch(reg)
+	{
+	case REG_PORTA:
+		return PortA;
+	case REG_PORTB:
+		return PortB;
+	case REG_PORTD:
+		return PortD;
+	default:
+		return PortCount;
+	}
+}
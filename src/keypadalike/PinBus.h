@@ -0,0 +1,110 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PIN_BUS_H
+#define _PIN_BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <avr/io.h>
+
+// one port write, see PinBus::Write
+struct PortWrite
+{
+	RegEnum Reg;
+	uint8_t Value;
+};
+
+/* Connects the output port pins to the peripherals.  Each subscriber
+ * registers the pins it is wired to, and a port write only calls the
+ * subscribers with a pin that changed.
+ *
+ * The bus is written with the ATtiny lock held, subscribers are called
+ * from there and can't access registers.
+ */
+class PinBus
+{
+public:
+	enum Port
+	{
+		PortA,
+		PortB,
+		PortD,
+		PortCount
+	};
+	class Subscriber
+	{
+	public:
+		virtual ~Subscriber() {}
+		// pins in changed (only the subscribed ones) on port are
+		// now value, called for each write
+		virtual void PinsChanged(Port port, uint8_t value,
+			uint8_t changed) = 0;
+		// called once at the end of a Write for the subscribers
+		// that saw a change
+		virtual void PinsSettled() {}
+		/* The pins in toggling (only the subscribed ones) were value
+		 * and toggle every half oscillator cycles from start, until
+		 * PinsChanged is called for them, see Toggle.  Otherwise
+		 * they look like they stayed at value.
+		 */
+		virtual void PinsToggling(Port port, uint8_t value,
+			uint8_t toggling, uint64_t start, uint64_t half) {}
+	};
+	PinBus();
+	// Subscribe with the same lock held as Write, there isn't any
+	// locking for the subscriber list.
+	void Subscribe(Subscriber *sub, Port port, uint8_t mask);
+	// The writes are applied in order, value only has the output
+	// direction bits set.
+	void Write(const PortWrite *writes, size_t count);
+	void Write(RegEnum reg, uint8_t value)
+	{
+		PortWrite write={reg, value};
+		Write(&write, 1);
+	}
+	/* The pins in mask toggle every half oscillator cycles from start
+	 * without a Write for each, see ToneOscillator.  Writes in the
+	 * meantime store the pins without calling the subscribers for
+	 * them, calling it again with mask 0 stops the toggling and calls
+	 * PinsChanged with the last value written.
+	 */
+	void Toggle(Port port, uint8_t mask, uint64_t start, uint64_t half);
+	// last value written to port
+	uint8_t Get(Port port) const { return Value[port]; }
+	// REG_PORTx to its Port, PortCount if it isn't an output port
+	static Port FromReg(RegEnum reg);
+private:
+	enum { MaxSubscribers=4 };
+	struct Subscription
+	{
+		Subscriber *Sub;
+		uint8_t Mask;
+	};
+	uint8_t Value[PortCount];
+	// pins that are toggling, see Toggle
+	uint8_t Toggling[PortCount];
+	Subscription Subs[PortCount][MaxSubscribers];
+	int SubCount[PortCount];
+};
+
+#endif // _PIN_BUS_H
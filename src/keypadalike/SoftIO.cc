@@ -25,29 +25,29 @@ hardware buttons and LEDs.
 #include <QHBoxLayout>
 #include <QVBoxLayout>
 #include <QKeyEvent>
-#include "LEDWidget.h"
+#include "LEDPanel.h"
 #include "SlotOwner.h"
+#include "LatencyTrace.h"
 #define XK_MISCELLANY
 #include <X11/keysymdef.h>
 
 #include <stdio.h>
 
 SoftIO::SoftIO() :
-	LEDState(0)
+	ButtonState(0)
 {
 	QVBoxLayout *vlayout=new QVBoxLayout;
-	QHBoxLayout *hled=new QHBoxLayout, *hbutton=new QHBoxLayout;
+	// both rows of LEDs, then both rows of buttons
+	LEDs=new LEDPanel;
+	vlayout->addWidget(LEDs);
+	QHBoxLayout *hbutton=new QHBoxLayout;
 	for(int i=0; i<BUTTON_COUNT; ++i)
 	{
 		if(i==BUTTON_COUNT/2)
 		{
-			vlayout->addLayout(hled);
 			vlayout->addLayout(hbutton);
-			hled=new QHBoxLayout;
 			hbutton=new QHBoxLayout;
 		}
-		LEDs[i]=new LEDWidget;
-		hled->addWidget(LEDs[i]);
 		// 1 based labels
 		Buttons[i]=new QCheckBox(QString("%1").arg(i+1));
 		hbutton->addWidget(Buttons[i]);
@@ -59,28 +59,23 @@ SoftIO::SoftIO() :
 		connect(owner, SIGNAL(SignalA(int, QObject*)),
 			SLOT(Clicked(int, QObject*)));
 	}
-	vlayout->addLayout(hled);
 	vlayout->addLayout(hbutton);
 	setLayout(vlayout);
 }
 
-void SoftIO::SetLEDs(uint16_t led)
+void SoftIO::SetLatencyTrace(LatencyTrace *trace)
 {
-	if(led == LEDState)
-		return;
+	LEDs->SetLatencyTrace(trace);
+}
 
-	for(int i=0; i<BUTTON_COUNT; ++i)
-	{
-		int b=1<<i;
-		// update if required
-		if((led ^ LEDState) & b)
-			LEDs[i]->SetOn(led & b);
-	}
-	LEDState=led;
+void SoftIO::SetLEDs(const LEDMailbox::Frame &frame)
+{
+	LEDs->SetLEDs(frame);
 }
 
 void SoftIO::Clicked(int state, QObject *sender)
 {
+	quint64 input=LatencyTrace::Now();
 	QAbstractButton *button=dynamic_cast<QAbstractButton*>(sender);
 	if(!button)
 		return;
@@ -90,7 +85,7 @@ void SoftIO::Clicked(int state, QObject *sender)
 		{
 			ButtonState &= ~(1<<i);
 			ButtonState |= (state?1:0)<<i;
-			SetButtons(ButtonState);
+			SetButtons(ButtonState, input);
 			break;
 		}
 	}
@@ -100,6 +95,7 @@ void SoftIO::keyPressEvent(QKeyEvent *event)
 {
 	if(event->isAutoRepeat())
 		return;
+	quint64 input=LatencyTrace::Now();
 	uint16_t state=ButtonState;
 	/* a through g is top row starting on the left
 	 * left alt is top right
@@ -168,7 +164,7 @@ void SoftIO::keyPressEvent(QKeyEvent *event)
 	}
 	if(state!=ButtonState)
 	{
-		SetButtons(ButtonState);
+		SetButtons(ButtonState, input);
 		UpdateButtons(state);
 	}
 }
@@ -177,6 +173,7 @@ void SoftIO::keyReleaseEvent(QKeyEvent *event)
 {
 	if(event->isAutoRepeat())
 		return;
+	quint64 input=LatencyTrace::Now();
 	uint16_t state=ButtonState;
 	switch(event->nativeVirtualKey())
 	{
@@ -235,7 +232,7 @@ void SoftIO::keyReleaseEvent(QKeyEvent *event)
 	}
 	if(state!=ButtonState)
 	{
-		SetButtons(ButtonState);
+		SetButtons(ButtonState, input);
 		UpdateButtons(state);
 	}
 }
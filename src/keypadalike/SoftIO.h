@@ -23,8 +23,10 @@ hardware buttons and LEDs.
 #define _SOFT_IO_H
 
 #include <QWidget>
+#include "LEDMailbox.h"
 class QCheckBox;
-class LEDWidget;
+class LEDPanel;
+class LatencyTrace;
 
 /* Instead of the hardware buttons and LEDs, do software push buttons and
  * colored circles in software.
@@ -35,13 +37,17 @@ class SoftIO : public QWidget
 	enum {BUTTON_COUNT=10};
 public:
 	SoftIO();
+	// The LEDs report their paints to trace.
+	void SetLatencyTrace(LatencyTrace *trace);
 
 public slots:
 	// like the hardware bit 0 to 9 is, 0 top left to top right,
-	// then bottom left to bottom right
-	void SetLEDs(uint16_t led);
+	// then bottom left to bottom right, with the intensity of each
+	// since the last frame
+	void SetLEDs(const LEDMailbox::Frame &frame);
 signals:
-	void SetButtons(uint16_t button);
+	// input is the LatencyTrace::Now time of the key or click
+	void SetButtons(uint16_t button, quint64 input);
 private slots:
 	void Clicked(int state, QObject *sender);
 protected:
@@ -50,9 +56,8 @@ protected:
 
 private:
 	void UpdateButtons(uint16_t was);
-	LEDWidget *LEDs[BUTTON_COUNT];
+	LEDPanel *LEDs;
 	QCheckBox *Buttons[BUTTON_COUNT];
-	uint16_t LEDState;
 	uint16_t ButtonState;
 };
 
@@ -0,0 +1,150 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SpeakerWav.h"
+#include "TimerScheduler.h"
+#include <algorithm>
+
+SpeakerWav::SpeakerWav(TimerScheduler *time, int sample_hz) :
+	Time(time),
+	File(NULL),
+	Value(0),
+	Synth(sample_hz),
+	End(UINT64_MAX),
+	Written(0)
+{
+}
+
+SpeakerWav::~SpeakerWav()
+{
+	Close();
+}
+
+bool SpeakerWav::Open(const char *path)
+{
+	QMutexLocker locker(&Mutex);
+	File=fopen(path, "wb");
+	if(!File)
+	{
+		perror(path);
+		return false;
+	}
+	uint32_t hz=Synth.GetSampleHz();
+	// the sizes are filled in by Close
+	fwrite("RIFF", 1, 4, File);
+	locked_Put32(0);
+	fwrite("WAVEfmt ", 1, 8, File);
+	locked_Put32(16);
+	// PCM, one channel
+	locked_Put32(1 | 1<<16);
+	locked_Put32(hz);
+	locked_Put32(hz*sizeof(int16_t));
+	// block align, bits per sample
+	locked_Put32(sizeof(int16_t) | 16<<16);
+	fwrite("data", 1, 4, File);
+	locked_Put32(0);
+	Synth.Restart(Time->Now());
+	return true;
+}
+
+void SpeakerWav::SetEnd(uint64_t end)
+{
+	QMutexLocker locker(&Mutex);
+	End=end;
+}
+
+void SpeakerWav::locked_Put32(uint32_t v)
+{
+	uint8_t buf[4]={(uint8_t)v, (uint8_t)(v>>8), (uint8_t)(v>>16),
+		(uint8_t)(v>>24)};
+	fwrite(buf, 1, sizeof(buf), File);
+}
+
+void SpeakerWav::PinsChanged(PinBus::Port port, uint8_t value,
+	uint8_t changed)
+{
+	int16_t s=SquareSynth::ToLevel(value & _BV(PD1), value & _BV(PD6));
+	QMutexLocker locker(&Mutex);
+	// the register is written for more reasons than just audio
+	if(s == Value)
+		return;
+	Value=s;
+	Edge edge={Time->Now(), 0, s, s};
+	locked_Push(edge);
+}
+
+void SpeakerWav::PinsToggling(PinBus::Port port, uint8_t value,
+	uint8_t toggling, uint64_t start, uint64_t half)
+{
+	uint8_t other=value ^ toggling;
+	Edge edge={start, half,
+		SquareSynth::ToLevel(value & _BV(PD1), value & _BV(PD6)),
+		SquareSynth::ToLevel(other & _BV(PD1), other & _BV(PD6))};
+	QMutexLocker locker(&Mutex);
+	// the level after isn't known, the next change is queued
+	Value=INT16_MIN;
+	locked_Push(edge);
+}
+
+void SpeakerWav::locked_Push(const Edge &edge)
+{
+	if(!File)
+		return;
+	// the edges so far are all there is up to now
+	locked_Render(Time->Now(), false);
+	Pending.Push(edge);
+}
+
+void SpeakerWav::locked_Render(uint64_t time, bool all)
+{
+	int16_t samples[BlockSamples];
+	time=std::min(time, End);
+	for(;;)
+	{
+		int64_t count=Synth.SamplesTo(time);
+		if(count > BlockSamples)
+			count=BlockSamples;
+		else if(!all || !count)
+			break;
+		Synth.Render(samples, count, Pending);
+		// little endian like SquareAudio plays them
+		fwrite(samples, sizeof(int16_t), count, File);
+		Written+=count;
+	}
+}
+
+void SpeakerWav::Close()
+{
+	QMutexLocker locker(&Mutex);
+	if(!File)
+		return;
+	locked_Render(Time->Now(), true);
+	uint32_t bytes=Written*sizeof(int16_t);
+	fseek(File, 4, SEEK_SET);
+	locked_Put32(36 + bytes);
+	fseek(File, 40, SEEK_SET);
+	locked_Put32(bytes);
+	if(ferror(File))
+		perror("SpeakerWav::Close");
+	fclose(File);
+	File=NULL;
+}
@@ -0,0 +1,95 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SPEAKER_WAV_H
+#define _SPEAKER_WAV_H
+
+#include <QMutex>
+#include <deque>
+#include <stdio.h>
+#include "PinBus.h"
+#include "SquareSynth.h"
+
+class TimerScheduler;
+
+/* Writes the speaker to a WAV file, for rendering a program's sound
+ * offline instead of playing it, see keypadalike-headless --wav.  The
+ * speaker pins are turned into samples by SquareSynth the same as
+ * SquareAudio, stamped with the chip's time, so with virtual time the
+ * file is the same every run however fast the host is.
+ *
+ * The edges are kept until a block of samples is due, and rendered on
+ * the thread changing the pins.  16 bit mono PCM, the sizes in the
+ * header are filled in by Close.
+ */
+class SpeakerWav : public PinBus::Subscriber
+{
+public:
+	enum
+	{
+		BlockSamples=4096
+	};
+	// time is the chip's, the file is written at sample_hz
+	SpeakerWav(TimerScheduler *time,
+		int sample_hz=SquareSynth::DefaultSampleHz);
+	~SpeakerWav();
+	// false with a message if path can't be created
+	bool Open(const char *path);
+	// nothing from end on is written
+	void SetEnd(uint64_t end);
+	// render the samples up to now or the end and finish the file
+	void Close();
+	// subscribed to PD1 and PD6
+	virtual void PinsChanged(PinBus::Port port, uint8_t value,
+		uint8_t changed);
+	virtual void PinsToggling(PinBus::Port port, uint8_t value,
+		uint8_t toggling, uint64_t start, uint64_t half);
+private:
+	typedef SquareSynth::Edge Edge;
+	// the queue SquareSynth::Render takes the edges from
+	class Edges
+	{
+	public:
+		const Edge* Front() const { return Queue.empty() ? NULL :
+			&Queue.front(); }
+		void Pop() { Queue.pop_front(); }
+		void Push(const Edge &edge) { Queue.push_back(edge); }
+	private:
+		std::deque<Edge> Queue;
+	};
+	void locked_Push(const Edge &edge);
+	// write the samples before time or End, only whole blocks unless all
+	void locked_Render(uint64_t time, bool all);
+	void locked_Put32(uint32_t v);
+
+	TimerScheduler *Time;
+	QMutex Mutex;
+	FILE *File;
+	// the level last queued
+	int16_t Value;
+	SquareSynth Synth;
+	Edges Pending;
+	uint64_t End;
+	uint64_t Written;
+};
+
+#endif // _SPEAKER_WAV_H
@@ -0,0 +1,79 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H
+
+#include <atomic>
+
+/* A bounded queue from one producer thread to one consumer thread without
+ * a lock.  Size must be a power of two.  The counts only ever increase,
+ * the slot is the count modulo Size, and each side only writes its own
+ * count, with release so the other side sees the slot before the count.
+ */
+template<class T, unsigned Size> class SpscQueue
+{
+	static_assert(Size && !(Size & (Size-1)),
+		"SpscQueue size must be a power of two");
+public:
+	SpscQueue() : Head(0), Tail(0) {}
+	// Producer, add value at the end, false if the queue is full.
+	bool Push(const T &value)
+	{
+		unsigned head=Head.load(std::memory_order_relaxed);
+		if(head - Tail.load(std::memory_order_acquire) == Size)
+			return false;
+		Items[head & (Size-1)]=value;
+		Head.store(head+1, std::memory_order_release);
+		return true;
+	}
+	// Consumer, the oldest value, NULL if the queue is empty.
+	const T* Front() const
+	{
+		unsigned tail=Tail.load(std::memory_order_relaxed);
+		if(tail == Head.load(std::memory_order_acquire))
+			return NULL;
+		return &Items[tail & (Size-1)];
+	}
+	// Consumer, remove the value returned by Front.
+	void Pop()
+	{
+		Tail.store(Tail.load(std::memory_order_relaxed)+1,
+			std::memory_order_release);
+	}
+	// Consumer, remove everything pushed so far.
+	void Clear()
+	{
+		Tail.store(Head.load(std::memory_order_acquire),
+			std::memory_order_release);
+	}
+private:
+	T Items[Size];
+	// each is written by one side, keep them on separate cache lines
+	// (padding, C++11 new doesn't align past the default)
+	char PadHead[64];
+	std::atomic<unsigned> Head;
+	char PadTail[64];
+	std::atomic<unsigned> Tail;
+};
+
+#endif // _SPSC_QUEUE_H
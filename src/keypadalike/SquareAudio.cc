@@ -21,124 +21,116 @@ hardware buttons and LEDs.
 */
 
 #include "SquareAudio.h"
-#include <QIODevice>
 #include <QtMultimediaKit/QAudioOutput>
 #include <QtMultimediaKit/QAudioFormat>
 #include <iostream>
 #include <stdio.h>
-#include <sys/types.h>
-#include <unistd.h>
-#include "util.h"
+#include "TimerScheduler.h"
+#include "VirtualClock.h"
 
 using namespace std;
 
-SquareAudio::SquareAudio() :
-	FirstTry(true),
-	Audio(NULL),
-	IODevice(NULL),
-	Value(0)
+SquareAudio::SquareAudio(TimerScheduler *time, int sample_hz) :
+	Time(time),
+	Value(0),
+	Started(false),
+	Dropped(0),
+	Synth(sample_hz),
+	Rendering(false)
 {
-	LastWrite.tv_sec=0;
-	LastWrite.tv_usec=0;
 }
 
 SquareAudio::~SquareAudio()
 {
-	delete Audio;
-	delete IODevice;
+	quit();
+	wait();
 }
 
 void SquareAudio::SetPins(bool pin0, bool pin1)
 {
-	const short range=2048;
-	int16_t s;
-	if(pin0 == pin1)
-		s=0;
-	else if(pin0)
-		s=range;
-	else
-		s=-range;
-	int16_t prev=Value;
+	int16_t s=SquareSynth::ToLevel(pin0, pin1);
+	// the register is written for more reasons than just audio
+	if(s == Value)
+		return;
 	Value=s;
-	const int freq=8000;
-	const int sample_bytes=2;
-	// buffer size in seconds
-	const double buffer=.050;
-	Samples.resize((int)(buffer*freq)*sample_bytes);
+	Edge edge={Time->Now(), 0, s, s};
+	Push(edge);
+}
+
+void SquareAudio::PinsToggling(PinBus::Port port, uint8_t value,
+	uint8_t toggling, uint64_t start, uint64_t half)
+{
+	uint8_t other=value ^ toggling;
+	Edge edge={start, half,
+		SquareSynth::ToLevel(value & _BV(PD1), value & _BV(PD6)),
+		SquareSynth::ToLevel(other & _BV(PD1), other & _BV(PD6))};
+	// the level after isn't known, the next SetPins is queued
+	Value=INT16_MIN;
+	Push(edge);
+}
 
-	if(!IODevice || !Audio)
+void SquareAudio::Push(const Edge &edge)
+{
+	if(!Edges.Push(edge))
+		++Dropped;
+	// Don't start the audio until there is a sound, the pins are also
+	// written when only the LEDs are being set or the buttons read.
+	if(!Started)
 	{
-		// Optimization, if it isn't initialized, and the value is
-		// still zero, ignore it to avoid starting audio when only
-		// the LEDs are being set or the buttons are being read and
-		// this is being called just because the register is being
-		// written to when the program isn't intending to produce
-		// audio.
-		if(!prev && !s)
-			return;
-
-		// Initialize only once.
-		if(!FirstTry)
-			return;
-
-		FirstTry=false;
-
-		// The calling thread should have been set to run on only
-		// one thread, but audio creates a new thread inheriting
-		// the current affinity.  Allow the audio thread to run on any
-		// cpu.
-		cpu_set_t mask, main;
-		sched_getaffinity(0, sizeof(mask), &mask);
-		// copy from the main thread
-		sched_getaffinity(getpid(), sizeof(main), &main);
-		sched_setaffinity(0, sizeof(main), &main);
-
-		QAudioFormat format;
-		format.setFrequency(freq);
-		format.setChannels(1);
-		format.setSampleSize(16);
-		format.setCodec("audio/pcm");
-		format.setByteOrder(QAudioFormat::LittleEndian);
-		format.setSampleType(QAudioFormat::SignedInt);
-
-		QAudioDeviceInfo info(QAudioDeviceInfo::defaultOutputDevice());
-		if(!info.isFormatSupported(format))
-		{
-			cerr << "audio format unsupported\n";
-			return;
-		}
-
-		Audio=new QAudioOutput(format);
-		Audio->setBufferSize(sample_bytes*(int)(buffer*freq));
-		IODevice=Audio->start();
-
-		sched_setaffinity(0, sizeof(mask), &mask);
-
-		if(!IODevice)
-			return;
+		Started=true;
+		start();
 	}
+}
 
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	double delta=now-LastWrite;
-
-	if(delta > buffer)
-		delta = buffer;
-	// skip extremely small time values as the register is written for
-	// more reasons than just audio
-	if(prev == Value && delta < .001)
+void SquareAudio::run()
+{
+	QAudioFormat format;
+	format.setFrequency(Synth.GetSampleHz());
+	format.setChannels(1);
+	format.setSampleSize(16);
+	format.setCodec("audio/pcm");
+	format.setByteOrder(QAudioFormat::LittleEndian);
+	format.setSampleType(QAudioFormat::SignedInt);
+
+	QAudioDeviceInfo info(QAudioDeviceInfo::defaultOutputDevice());
+	if(!info.isFormatSupported(format))
+	{
+		cerr << "audio format unsupported\n";
 		return;
+	}
 
-	int count=(int)(delta*freq+.5);
-	if(!count)
-		return;
+	// created here so the output pulls from this thread's event loop
+	QAudioOutput audio(format);
+	audio.setBufferSize(sizeof(int16_t)*Synth.GetSampleHz()*
+		BufferMs/1000);
+	Source source(this);
+	source.open(QIODevice::ReadOnly);
+	audio.start(&source);
+	exec();
+	audio.stop();
+}
 
-	LastWrite=now;
-	
-	// This is audio until now which uses the previous speaker setting.
-	for(int i=0; i<count; ++i)
-		Samples[i]=Value;
-	
-	IODevice->write((char*)Samples.data(), count*sample_bytes);
-	//printf("time delta %8.6f, %4u samples written\n", delta, count);
+qint64 SquareAudio::Source::readData(char *data, qint64 maxlen)
+{
+	int count=maxlen/sizeof(int16_t);
+	Owner->Render((int16_t*)data, count);
+	return count*sizeof(int16_t);
+}
+
+void SquareAudio::Render(int16_t *samples, int count)
+{
+	const uint64_t delay=(uint64_t)VirtualClock::OscillatorHz*DelayMs/1000;
+	uint64_t now=Time->Now();
+	uint64_t target=now > delay ? now - delay : 0;
+	// Start at, or come back to, Delay behind the chip when the sound
+	// card's clock drifted or the program paused or raced ahead with
+	// virtual time.  The edges before that are applied right away.
+	uint64_t at=Synth.GetTime();
+	uint64_t drift=at > target ? at - target : target - at;
+	if(!Rendering || drift > delay)
+	{
+		Synth.Restart(target);
+		Rendering=true;
+	}
+	Synth.Render(samples, count, Edges);
 }
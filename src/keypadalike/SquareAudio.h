@@ -23,33 +23,87 @@ hardware buttons and LEDs.
 #ifndef _SQUARE_AUDIO_H
 #define _SQUARE_AUDIO_H
 
-#include <QVector>
-#include <sys/time.h>
+#include <QThread>
+#include <QIODevice>
+#include <atomic>
+#include "PinBus.h"
+#include "SpscQueue.h"
+#include "SquareSynth.h"
 
-class QIODevice;
 class QAudioOutput;
+class TimerScheduler;
 
 /* Given a speaker connected between two microcontroller pins, generate
  * audio for the sound card to playback.
+ *
+ * The pins change on the program's thread, often from a timer interrupt
+ * at kHz rates, with the bus lock held.  SetPins only queues the new level
+ * with the chip's time on a lock-free queue.  The audio output runs on its
+ * own thread (started with the first sound) and pulls samples, which are
+ * rendered from the queued edges a fixed Delay behind the chip's time, so
+ * the speaker never waits on the sound card and the sound card never
+ * waits on the program.  A tone from the ToneOscillator is queued once
+ * with its period and rendered from that.  SquareSynth turns the edges
+ * into samples.
  */
-class SquareAudio
+class SquareAudio : public QThread, public PinBus::Subscriber
 {
 public:
-	SquareAudio();
+	enum
+	{
+		// how far behind the chip's time the samples are rendered,
+		// time for the edges to arrive, milliseconds
+		DelayMs=50,
+		// the output buffer, milliseconds
+		BufferMs=50,
+		QueueSize=4096
+	};
+	// time is the chip's, samples are played at sample_hz
+	SquareAudio(TimerScheduler *time, 
+		int sample_hz=SquareSynth::DefaultSampleHz);
+	// stops the audio thread
 	~SquareAudio();
 	void SetPins(bool pin0, bool pin1);
+	// subscribed to PD1 and PD6
+	virtual void PinsChanged(PinBus::Port port, uint8_t value,
+		uint8_t changed)
+	{
+		SetPins(value & _BV(PD1), value & _BV(PD6));
+	}
+	virtual void PinsToggling(PinBus::Port port, uint8_t value,
+		uint8_t toggling, uint64_t start, uint64_t half);
+	// edges dropped because the audio thread fell behind
+	uint64_t GetDropped() const { return Dropped; }
+protected:
+	void run();
 private:
-	// The audio device is created on the first SetPins call, but if that
-	// fails, don't keep trying to open the device, just ignore any
-	// more SetPins request.  This stores if the first open request has
-	// been attempted.
-	bool FirstTry;
-	QAudioOutput *Audio;
-	QIODevice *IODevice;
-	QVector<int16_t> Samples;
-	// The current value of the pins.
+	// The device the audio output pulls the samples from.
+	class Source : public QIODevice
+	{
+	public:
+		Source(SquareAudio *owner) : Owner(owner) {}
+	protected:
+		qint64 readData(char *data, qint64 maxlen);
+		qint64 writeData(const char *data, qint64 len) { return -1; }
+	private:
+		SquareAudio *Owner;
+	};
+	typedef SquareSynth::Edge Edge;
+	void Push(const Edge &edge);
+	// Audio thread, fill count samples up to Delay before now.
+	void Render(int16_t *samples, int count);
+
+	TimerScheduler *Time;
+	// Program's thread, the level last queued and if the audio thread
+	// was started, it is only started once there is a sound.
 	int16_t Value;
-	struct timeval LastWrite;
+	bool Started;
+	SpscQueue<Edge, QueueSize> Edges;
+	std::atomic<uint64_t> Dropped;
+
+	// Audio thread
+	SquareSynth Synth;
+	bool Rendering;
 };
 
 #endif // _SQUARE_AUDIO_H
@@ -0,0 +1,171 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SquareSynth.h"
+#include "VirtualClock.h"
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+SquareSynth::SquareSynth(int sample_hz) :
+	SampleHz(sample_hz),
+	Origin(0),
+	Sample(0),
+	Toggle(1),
+	Level(0),
+	Samples(NULL),
+	Count(0),
+	Filled(0),
+	Blep(1),
+	Corrected(false)
+{
+	Edge silent={0, 0, 0, 0};
+	Current=silent;
+}
+
+int16_t SquareSynth::ToLevel(bool pin0, bool pin1)
+{
+	const short range=2048;
+	if(pin0 == pin1)
+		return 0;
+	return pin0 ? range : -range;
+}
+
+void SquareSynth::Restart(uint64_t time)
+{
+	Origin=time;
+	Sample=0;
+	Blep[0]=0;
+}
+
+uint64_t SquareSynth::SampleTime(int i) const
+{
+	return Origin + (Sample+i)*VirtualClock::OscillatorHz/SampleHz;
+}
+
+int64_t SquareSynth::SamplesTo(uint64_t time) const
+{
+	if(time <= Origin)
+		return 0;
+	// the samples at or after time aren't counted
+	uint64_t n=((time - Origin)*SampleHz + VirtualClock::OscillatorHz - 1)/
+		VirtualClock::OscillatorHz;
+	return n > Sample ? n - Sample : 0;
+}
+
+uint64_t SquareSynth::NextToggle() const
+{
+	if(!Current.Half)
+		return UINT64_MAX;
+	return Current.Stamp + Toggle*Current.Half;
+}
+
+// Fill n samples with value.
+static void Fill(int16_t *samples, int n, int16_t value)
+{
+	int i=0;
+#ifdef __SSE2__
+	__m128i v=_mm_set1_epi16(value);
+	for(; i+8<=n; i+=8)
+		_mm_storeu_si128((__m128i*)(samples+i), v);
+#endif
+	for(; i<n; ++i)
+		samples[i]=value;
+}
+
+void SquareSynth::Begin(int16_t *samples, int count)
+{
+	Samples=samples;
+	Count=count;
+	Filled=0;
+	if((int)Blep.size() < count+1)
+		Blep.resize(count+1);
+	memset(&Blep[1], 0, count*sizeof(float));
+	Corrected=Blep[0]!=0;
+	// After a Restart skip to the last toggle of a tone before the
+	// block instead of stepping through every one.
+	uint64_t start=SampleTime(0);
+	if(Current.Half && start > Current.Stamp)
+	{
+		uint64_t last=(start - Current.Stamp)/Current.Half;
+		if(last > Toggle)
+			Toggle=last;
+	}
+}
+
+void SquareSynth::Step(uint64_t time, int16_t level)
+{
+	if(level == Level)
+		return;
+	// where time falls in samples from the first of the block
+	double at=((int64_t)(time - Origin)*SampleHz -
+		(int64_t)Sample*VirtualClock::OscillatorHz) /
+		(double)VirtualClock::OscillatorHz;
+	float step=level - Level;
+	int after=0;
+	// an edge late for the block is applied from its start
+	if(at > 0)
+	{
+		after=(int)ceil(at);
+		if(after > Count)
+			after=Count;
+		float a=after - at;
+		Blep[after-1]+=step*a*a/2;
+		Blep[after]-=step*(1-a)*(1-a)/2;
+		Corrected=true;
+	}
+	Fill(Samples+Filled, after-Filled, Level);
+	Filled=after;
+	Level=level;
+}
+
+void SquareSynth::Finish()
+{
+	Fill(Samples+Filled, Count-Filled, Level);
+	int i=0;
+	if(Corrected)
+	{
+#ifdef __SSE2__
+		for(; i+8<=Count; i+=8)
+		{
+			__m128i lo=_mm_cvtps_epi32(_mm_loadu_ps(&Blep[i]));
+			__m128i hi=_mm_cvtps_epi32(_mm_loadu_ps(&Blep[i+4]));
+			__m128i *s=(__m128i*)(Samples+i);
+			_mm_storeu_si128(s, _mm_adds_epi16(_mm_loadu_si128(s),
+				_mm_packs_epi32(lo, hi)));
+		}
+#endif
+		for(; i<Count; ++i)
+		{
+			int v=Samples[i] + lrintf(Blep[i]);
+			Samples[i]=v < INT16_MIN ? INT16_MIN :
+				v > INT16_MAX ? INT16_MAX : v;
+		}
+	}
+	Blep[0]=Blep[Count];
+	// move whole seconds into Origin to keep the products small
+	Sample+=Count;
+	Origin+=Sample/SampleHz*VirtualClock::OscillatorHz;
+	Sample%=SampleHz;
+}
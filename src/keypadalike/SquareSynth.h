@@ -0,0 +1,128 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SQUARE_SYNTH_H
+#define _SQUARE_SYNTH_H
+
+#include <stdint.h>
+#include <vector>
+
+/* Render the speaker's square wave from the times of its edges to samples
+ * at any rate.  Rounding each edge to the nearest sample aliases, a tone
+ * between two sample periods beats and a pitch sweep steps.  Instead each
+ * edge is placed where it falls between two samples with a band-limited
+ * step (polyBLEP), the step plus a two sample correction that depends on
+ * the fraction of a sample the edge is from them.
+ *
+ * A block is rendered by filling each level run and adding the
+ * corrections after, both SIMD, the work per edge is constant and the
+ * rest is the cost of a memset, so a higher rate costs little more than a
+ * lower one.  Times are oscillator cycles (VirtualClock::OscillatorHz),
+ * a sample lands between cycles when the rate doesn't divide it.
+ */
+class SquareSynth
+{
+public:
+	enum
+	{
+		DefaultSampleHz=48000
+	};
+	// The level from Stamp, or for a tone Level and Other alternate
+	// every Half cycles, the first Other at Stamp.
+	struct Edge
+	{
+		uint64_t Stamp;
+		uint64_t Half;
+		int16_t Level;
+		int16_t Other;
+	};
+	SquareSynth(int sample_hz);
+	// the level of a speaker connected between pin0 and pin1
+	static int16_t ToLevel(bool pin0, bool pin1);
+	int GetSampleHz() const { return SampleHz; }
+	// the time of the next sample
+	uint64_t GetTime() const { return SampleTime(0); }
+	// the next sample is at time, edges before it are applied right away
+	void Restart(uint64_t time);
+	// the number of samples from the next one before time
+	int64_t SamplesTo(uint64_t time) const;
+	/* Fill count samples, taking the edges up to the end of them from
+	 * edges, an SpscQueue or anything else with Front and Pop.  The
+	 * edges must be in time order.
+	 */
+	template<class Queue> void Render(int16_t *samples, int count,
+		Queue &edges);
+private:
+	// time of the sample i from the next one
+	uint64_t SampleTime(int i) const;
+	void Begin(int16_t *samples, int count);
+	// the next time the tone changes, UINT64_MAX for none
+	uint64_t NextToggle() const;
+	// change the output to level at time
+	void Step(uint64_t time, int16_t level);
+	void Finish();
+
+	int SampleHz;
+	// sample Sample is at Origin + Sample*OscillatorHz/SampleHz, Sample
+	// is kept under a second
+	uint64_t Origin;
+	uint64_t Sample;
+	// the level or tone, the toggle number of its next change
+	Edge Current;
+	uint64_t Toggle;
+	int16_t Level;
+
+	// the block being rendered, filled up to Filled
+	int16_t *Samples;
+	int Count;
+	int Filled;
+	// corrections for Count+1 samples, the last carries to the next block
+	std::vector<float> Blep;
+	bool Corrected;
+};
+
+template<class Queue>
+void SquareSynth::Render(int16_t *samples, int count, Queue &edges)
+{
+	Begin(samples, count);
+	uint64_t end=SampleTime(count);
+	for(;;)
+	{
+		uint64_t toggle=NextToggle();
+		const Edge *edge=edges.Front();
+		if(edge && edge->Stamp <= end && edge->Stamp <= toggle)
+		{
+			Current=*edge;
+			Toggle=1;
+			edges.Pop();
+			Step(Current.Stamp, Current.Other);
+			continue;
+		}
+		if(toggle > end)
+			break;
+		Step(toggle, Toggle & 1 ? Current.Level : Current.Other);
+		++Toggle;
+	}
+	Finish();
+}
+
+#endif // _SQUARE_SYNTH_H
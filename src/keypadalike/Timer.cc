@@ -22,120 +22,319 @@ hardware buttons and LEDs.
 
 #include "Timer.h"
 #include <QMutexLocker>
+#include <algorithm>
 #include "ATtiny.h"
-#include <dlfcn.h>
+#include "ChipState.h"
+#include "util.h"
 
-Timer::Timer(const uint8_t *reg, const char *capt, const char *comp_a,
-	const char *comp_b, const char *ovf) :
-	Capt(NULL),
-	CompA(NULL),
-	CompB(NULL),
-	Ovf(NULL),
-	SystemClockHz(1)
+Timer::Timer(ATtiny *chip, const uint8_t *reg) :
+	Chip(chip),
+	SystemClockHz(1),
+	Zero(0),
+	End(UINT64_MAX),
+	Index(0),
+	Generation(0),
+	Stride(1),
+	Gap(0),
+	Skip(0)
 {
 	memcpy(Reg, reg, sizeof(Reg));
-	struct
+	memset(SleepSequence, 0, sizeof(SleepSequence));
+}
+
+void Timer::SetSysteClock(uint32_t hz)
+{
+	SystemClockHz=hz;
+	UpdateSleep();
+}
+
+void Timer::SetSequence(const Seq *seq)
+{
+	QMutexLocker locker(&Mutex);
+	if(seq)
+		memcpy(SleepSequence, seq, sizeof(SleepSequence));
+	else
+		memset(SleepSequence, 0, sizeof(SleepSequence));
+	++Generation;
+	Gap=0;
+
+	const size_t count=sizeof(SleepSequence)/sizeof(*SleepSequence);
+	size_t i;
+	for(i=0; i<count && !SleepSequence[i].Cycles; ++i)
+		;
+	if(i==count)
 	{
-		const char *name;
-		void (**f)();
-	} funcs[] = {
-		{capt, &Capt},
-		{comp_a, &CompA},
-		{comp_b, &CompB},
-		{ovf, &Ovf}};
-	for(size_t i=0; i<sizeof(funcs)/sizeof(*funcs); ++i)
+		End=UINT64_MAX;
+		return;
+	}
+	uint64_t now=Chip->Scheduler().Now();
+	// start counting if it was stopped
+	if(End==UINT64_MAX)
+		Zero=now;
+	Index=i;
+	End=Zero+SleepSequence[i].Cycles;
+	// If the counter is already past the new match value the
+	// hardware would count all the way around, start over instead.
+	if(End <= now)
 	{
-		if(!funcs[i].name)
-			continue;
-		/* Note dlsym can only find symbols in shared objects,
-		 * if the function is compiled into the executable it
-		 * will not find it.
-		 */
-		if(void *sym=dlsym(RTLD_DEFAULT, funcs[i].name))
+		Zero=now;
+		End=now+SleepSequence[i].Cycles;
+	}
+	locked_Schedule();
+}
+
+void Timer::locked_Schedule()
+{
+	Chip->Scheduler().Schedule(this, End, Generation);
+}
+
+void Timer::locked_Advance()
+{
+	// Find the next entry to sleep on, the current entry is non-zero so
+	// it will stop there if there aren't any others.
+	const size_t count=sizeof(SleepSequence)/sizeof(*SleepSequence);
+	Skip+=Gap;
+	for(uint32_t n=0; n<Stride; ++n)
+	{
+		uint64_t end=End;
+		size_t i=Index;
+		do
 		{
-			//printf("%s is %p\n", funcs[i].name, sym);
-			*funcs[i].f=(void(*)())sym;
-		}
-		/*
-		else
+			if(++i==count)
+			{
+				i=0;
+				Zero=end;
+			}
+		} while(!SleepSequence[i].Cycles);
+		Index=i;
+		End=end+SleepSequence[i].Cycles;
+	}
+	Gap=Stride-1;
+}
+
+void Timer::SetStride(uint32_t stride)
+{
+	QMutexLocker locker(&Mutex);
+	uint64_t now=Chip->Scheduler().Now();
+	if(Gap && End!=UINT64_MAX)
+	{
+		// the counter is back to where the skipped ones have run
+		Zero=locked_Zero(now);
+		// the skipped ones that haven't passed are run again
+		uint64_t cycles=SleepSequence[Index].Cycles;
+		uint64_t first=End-Gap*cycles;
+		uint64_t passed=now >= first ?
+			std::min<uint64_t>((now-first)/cycles+1, Gap) : 0;
+		Skip+=passed;
+		if(passed < Gap)
 		{
-			printf("%s not found\n", funcs[i].name);
+			End=first+passed*cycles;
+			++Generation;
+			locked_Schedule();
 		}
-		*/
 	}
+	Gap=0;
+	Stride=stride ? stride : 1;
 }
 
-void Timer::SetSysteClock(uint32_t hz)
+uint64_t Timer::locked_Zero(uint64_t now)
 {
-	SystemClockHz=hz;
-	UpdateSleep();
+	if(!Gap || End==UINT64_MAX || Zero <= now)
+		return Zero;
+	// Zero is at the last skipped deadline, each one is a wrap, the
+	// counter was last zero at the one that passed last.
+	uint64_t cycles=SleepSequence[Index].Cycles;
+	uint64_t first=End-Gap*cycles;
+	uint64_t passed=now >= first ?
+		std::min<uint64_t>((now-first)/cycles+1, Gap) : 0;
+	return first+passed*cycles-cycles;
 }
 
-void Timer::run()
+uint64_t Timer::Skipped(uint64_t now)
 {
-	bool running;
-	for(;;)
+	QMutexLocker locker(&Mutex);
+	uint64_t skipped=Skip;
+	if(Gap && End!=UINT64_MAX)
 	{
-		running=false;
-		for(size_t i=0; i<sizeof(SleepSequence)/sizeof(*SleepSequence);
-			++i)
+		uint64_t cycles=SleepSequence[Index].Cycles;
+		uint64_t first=End-Gap*cycles;
+		if(now >= first)
+			skipped+=std::min<uint64_t>((now-first)/cycles+1, Gap);
+	}
+	return skipped;
+}
+
+bool Timer::Deadline(uint64_t *end, uint64_t *cycles)
+{
+	QMutexLocker locker(&Mutex);
+	if(End==UINT64_MAX)
+		return false;
+	*end=End;
+	*cycles=SleepSequence[Index].Cycles;
+	return true;
+}
+
+uint32_t Timer::locked_Missed(uint64_t now, uint32_t raise)
+{
+	TimerScheduler &scheduler=Chip->Scheduler();
+	TimerScheduler::MissPolicy policy=scheduler.GetMissPolicy();
+	uint32_t count=0;
+	switch(policy)
+	{
+	case TimerScheduler::CatchUp:
+		// End is left in the past, the next one runs right after
+		count=1;
+		break;
+	case TimerScheduler::Coalesce:
+		// one interrupt for all the deadlines that have passed
+		while(End <= now)
 		{
-			Seq seq;
-			{
-				QMutexLocker locker(&Mutex);
-				seq=SleepSequence[i];
-			}
-			if(seq.Duration.tv_sec || seq.Duration.tv_nsec)
-			{
-				if(!running)
-				{
-					// Store when the counter would have
-					// been 0.
-					gettimeofday(&Start, NULL);
-					running=true;
-				}
-				nanosleep(&seq.Duration, NULL);
-				Reg[REG_TIFR]|=seq.IrqFlag;
-				if(seq.func)
-				{
-					Reg[REG_TIFR]&=~seq.IrqFlag;
-					g_ATtiny.IntStart();
-					seq.func();
-					g_ATtiny.IntStop();
-				}
-			}
+			raise|=InterruptController::Bit(
+				SleepSequence[Index].Vector);
+			locked_Advance();
+			++count;
 		}
-		if(!running)
+		break;
+	case TimerScheduler::Skip:
+		// this one runs, the ones that passed after it don't
+		while(End <= now)
 		{
-			QMutexLocker locker(&Mutex);
-			Cond.wait(&Mutex);
+			locked_Advance();
+			++count;
 		}
+		break;
+	default:
+		break;
 	}
+	scheduler.CountMissed(policy, count);
+	return raise;
 }
 
-double Timer::SecPerTick(RegEnum tccrxb)
+void Timer::Expire(uint32_t generation)
+{
+	uint32_t raise;
+	{
+		QMutexLocker locker(&Mutex);
+		if(generation!=Generation || End==UINT64_MAX)
+			return;
+		raise=InterruptController::Bit(SleepSequence[Index].Vector);
+		locked_Advance();
+		// The virtual time is exact, with the wall clock the next
+		// deadline can have passed already.
+		if(!Chip->Clock().IsEnabled())
+		{
+			uint64_t now=Chip->Scheduler().Now();
+			if(End <= now)
+				raise=locked_Missed(now, raise);
+		}
+		// Scheduled before the handler runs, if the handler changes
+		// the timer that replaces this one.
+		locked_Schedule();
+	}
+
+	InterruptController &irq=Chip->Interrupts();
+	raise&=~InterruptController::Bit(InterruptController::VectorReset);
+	for(int i=0; raise; ++i)
+	{
+		uint32_t bit=InterruptController::Bit(
+			(InterruptController::Vector)i);
+		if(!(raise & bit))
+			continue;
+		irq.Raise((InterruptController::Vector)i);
+		raise&=~bit;
+	}
+	// With interrupts disabled it runs on a later Dispatch.
+	irq.Dispatch();
+}
+
+void Timer::SaveState(ChipState *state, uint64_t now)
+{
+	QMutexLocker locker(&Mutex);
+	state->Put(Reg, sizeof(Reg));
+	state->Put(SystemClockHz);
+	state->Put(SleepSequence, sizeof(SleepSequence));
+	state->Put((int64_t)(Zero-now));
+	state->Put(End==UINT64_MAX);
+	state->Put((int64_t)(End-now));
+	state->Put((uint32_t)Index);
+}
+
+void Timer::RestoreState(ChipState *state, uint64_t now)
+{
+	QMutexLocker locker(&Mutex);
+	state->Get(Reg, sizeof(Reg));
+	SystemClockHz=state->Get<uint32_t>();
+	state->Get(SleepSequence, sizeof(SleepSequence));
+	Zero=now+state->Get<int64_t>();
+	bool stopped=state->Get<bool>();
+	End=now+state->Get<int64_t>();
+	Index=state->Get<uint32_t>();
+	Stride=1;
+	Gap=0;
+	const size_t count=sizeof(SleepSequence)/sizeof(*SleepSequence);
+	if(stopped || Index >= count || state->Failed())
+	{
+		memset(SleepSequence, 0, sizeof(SleepSequence));
+		End=UINT64_MAX;
+		Index=0;
+	}
+	// the old schedule is dropped
+	++Generation;
+	if(End!=UINT64_MAX)
+		locked_Schedule();
+}
+
+uint32_t Timer::Prescale(RegEnum tccrxb)
 {
 	uint8_t clock=Reg[tccrxb] & 0x7;
-	double prescale;
 	switch(clock)
 	{
 	case 1:
-		prescale=1;
-		break;
+		return 1;
 	case 2:
-		prescale=8;
-		break;
+		return 8;
 	case 3:
-		prescale=64;
-		break;
+		return 64;
 	case 4:
-		prescale=256;
-		break;
+		return 256;
 	default:
 	case 5:
-		prescale=1024;
-		break;
+		return 1024;
+	}
+}
+
+uint64_t Timer::CyclesPerTick(RegEnum tccrxb)
+{
+	return (uint64_t)Prescale(tccrxb) *
+		(VirtualClock::OscillatorHz/SystemClockHz);
+}
+
+double Timer::ElapsedTicks(RegEnum tccrxb)
+{
+	uint64_t now=Chip->Scheduler().Now();
+	QMutexLocker locker(&Mutex);
+	return (double)(now-locked_Zero(now))/CyclesPerTick(tccrxb);
+}
+
+void Timer::SetCounter(RegEnum tccrxb, uint16_t value)
+{
+	QMutexLocker locker(&Mutex);
+	uint64_t now=Chip->Scheduler().Now();
+	uint64_t elapsed=value*CyclesPerTick(tccrxb);
+	Zero=elapsed < now ? now-elapsed : 0;
+	// the next match moves with the counter
+	if(End!=UINT64_MAX)
+	{
+		// the entries are from the one before, Index is counted from
+		// the counter's zero through all of them
+		uint64_t match=0;
+		for(size_t i=0; i<=Index; ++i)
+			match+=SleepSequence[i].Cycles;
+		End=Zero+match;
+		if(End <= now)
+			End=now+SleepSequence[Index].Cycles;
+		Gap=0;
+		++Generation;
+		locked_Schedule();
 	}
-	// seconds per clock tick
-	return prescale/SystemClockHz;
 }
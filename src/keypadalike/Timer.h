@@ -23,79 +23,122 @@ hardware buttons and LEDs.
 #ifndef _TIMER_H
 #define _TIMER_H
 
-#include <QThread>
 #include <QMutex>
-#include <QWaitCondition>
-#include <sys/time.h>
-#include <time.h>
 #include <avr/io.h>
+#include "InterruptController.h"
+#include "TimerScheduler.h"
+
+class ATtiny;
+class ChipState;
 
 /* Base class for timer operations.  It contains timer and routines common
  * to all timers.  The derived timers deal with the actual registers and setup.
- * Don't add any slots because exec won't be called and they won't be received.
+ * The timer doesn't have a thread of its own, the TimerScheduler calls
+ * Expire when the next entry in the SleepSequence is due.
  */
-class Timer : public QThread
+class Timer : public TimerScheduler::Client
 {
-	Q_OBJECT
 public:
-	/* The arguments are the string names of the interrupt handlers to
-	 * call.  They are resolved at runtime because not all programs
-	 * will have all interrupt handlers.  Pass NULL if the timer doesn't
-	 * have that handler.
-	 * Not all interrupts have been coded up to trigger yet.
-	 */
-	Timer(const uint8_t *reg, const char *capt, const char *comp_a,
-		const char *comp_b, const char *ovf);
+	// chip is the ATtiny the timer belongs to
+	Timer(ATtiny *chip, const uint8_t *reg);
 	virtual void Set(RegEnum reg, uint8_t value) = 0;
 	virtual uint8_t Get(RegEnum reg) = 0;
 	void SetSysteClock(uint32_t hz);
+
+	/* Called from the TimerScheduler when the deadline scheduled with
+	 * generation is reached, raises the interrupt flag with the
+	 * InterruptController, and schedules the next entry.  Does nothing
+	 * if the registers were changed since, that scheduled a new
+	 * generation.
+	 */
+	virtual void Expire(uint32_t generation);
+
+	/* Append the registers and the schedule to state, the times
+	 * relative to now.  RestoreState reads them back relative to now,
+	 * which can be a different chip's time, and schedules the timer.
+	 */
+	void SaveState(ChipState *state, uint64_t now);
+	void RestoreState(ChipState *state, uint64_t now);
+	// Stop counting, like a timer that was never started.
+	void Stop() { SetSequence(NULL); }
+	/* Only schedule every stride-th deadline, the ones in between are
+	 * skipped and counted in Skipped, the ToneOscillator does what the
+	 * handler would have.  Changing it makes the next deadline that
+	 * hasn't passed the next one scheduled.  Only for a timer with one
+	 * SleepSequence entry, as Timer1 has.
+	 */
+	void SetStride(uint32_t stride);
+	// the count of skipped deadlines up to now
+	uint64_t Skipped(uint64_t now);
+	// The next deadline and the cycles between them, false if stopped.
+	bool Deadline(uint64_t *end, uint64_t *cycles);
 protected:
 	// Where the sleep time should be updated.  Called from the base
 	// class when the system clock rate chanes.
 	virtual void UpdateSleep() = 0;
-	void run();
-
-	/* Capture interrupt is used to record the counter time to
-	 * 16 bit ICR1 when an event occurs.
-	 */
-	void (*Capt)();
-	// timer matches A
-	void (*CompA)();
-	// timer matches B
-	void (*CompB)();
-	// timer overflow */
-	void (*Ovf)();
 
-	double SecPerTick(RegEnum tccrxb);
+	// timer clock prescaler selected by the clock select bits
+	uint32_t Prescale(RegEnum tccrxb);
+	// oscillator cycles per timer clock tick
+	uint64_t CyclesPerTick(RegEnum tccrxb);
+	// Number of timer clock ticks since the counter was last zero.
+	double ElapsedTicks(RegEnum tccrxb);
+	// The program wrote value to the counter.
+	void SetCounter(RegEnum tccrxb, uint16_t value);
 
+	ATtiny *Chip;
 	uint8_t Reg[REG_SREG];
 	uint32_t SystemClockHz;
 
-	// The time the counter last started at zero.
-	struct timeval Start;
 	/* The hardware timer would count from zero and match at three
 	 * different locations, A, B, and finally overflow, it can be
-	 * configured to reset at any.  This thread will sleep with the
+	 * configured to reset at any.  The entries are scheduled with the
 	 * given duration one after the other and make the call back each
-	 * time the sleep is finished.  If the duration is zero it will
-	 * be skipped, if the callback is NULL the sleep will happen the
-	 * callback won't, and if all the durations are zero it will
-	 * block on the condition variable.
+	 * time the duration is finished.  If the duration is zero it will
+	 * be skipped, and if all the durations are zero the timer is
+	 * stopped.
 	 */
 	struct Seq
 	{
-		struct timespec Duration;
-		// When the interrupt goes off this flag is set, and cleared
-		// by writing 1 to the register or when the interrupt vector
-		// executes.
-		uint8_t IrqFlag;
-		void (*func)();
+		// duration in oscillator cycles
+		uint64_t Cycles;
+		// The interrupt flag to raise, the handler runs if it is
+		// enabled in TIMSK.  VectorReset for none.
+		InterruptController::Vector Vector;
 	} SleepSequence[3];
+	/* Install a new SleepSequence, or stop the timer if seq is NULL.
+	 * The new values take effect immediately, the counter continues
+	 * from where it was.
+	 */
+	void SetSequence(const Seq *seq);
+	// Schedule End with the current Generation.
+	void locked_Schedule();
+	// Move to the next non-zero SleepSequence entry.
+	void locked_Advance();
+	// Zero as of now, with a stride Zero is ahead at the last skipped
+	// deadline.
+	uint64_t locked_Zero(uint64_t now);
+	/* With the wall clock, the deadline after seq has already passed
+	 * at now, apply the TimerScheduler::MissPolicy, returns the
+	 * vectors to raise now.
+	 */
+	uint32_t locked_Missed(uint64_t now, uint32_t raise);
 
-	// When the timer isn't actively running it is waiting on the Cond
-	// variable.
 	QMutex Mutex;
-	QWaitCondition Cond;
+
+	// In oscillator cycles from the TimerScheduler.  The time the
+	// counter was last zero, and when the SleepSequence entry Index
+	// completes (UINT64_MAX when stopped).
+	uint64_t Zero;
+	uint64_t End;
+	size_t Index;
+	// incremented each time the schedule is changed
+	uint32_t Generation;
+	// See SetStride, Gap deadlines before End are skipped, Skip counts
+	// the ones before that.
+	uint32_t Stride;
+	uint32_t Gap;
+	uint64_t Skip;
 };
 
 #endif // _TIMER_H
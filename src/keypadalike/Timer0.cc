@@ -24,31 +24,27 @@ hardware buttons and LEDs.
 #include "util.h"
 #include <math.h>
 
-Timer0::Timer0(const uint8_t *reg) :
-	Timer(reg, NULL, "TIMER0_COMPA_vect", "TIMER0_COMPB_vect",
-		"TIMER0_OVF_vect")
+Timer0::Timer0(ATtiny *chip, const uint8_t *reg) :
+	Timer(chip, reg)
 {
 }
 
 void Timer0::Set(RegEnum reg, uint8_t value)
 {
-	if(reg==REG_TIFR)
+	Reg[reg]=value;
+
+	if(reg==REG_TCNT0)
 	{
-		// writing 1 clears the flag
-		Reg[REG_TIFR] &= ~value;
+		SetCounter(REG_TCCR0B, value);
 		return;
 	}
 
-	Reg[reg]=value;
-
 	UpdateSleep();
 }
 
 void Timer0::UpdateSleep()
 {
-	// There isn't currently any way for the timer thread to restart
-	// based on updated registers values.  It will only complete the
-	// current sleep and start the next one.
+	// The new values take effect immediately, see SetSequence.
 	uint8_t mode=
 		((Reg[REG_TCCR0B] & _BV(WGM02))>>1) |
 		(Reg[REG_TCCR0A] & _BV(WGM01)) |
@@ -81,49 +77,35 @@ void Timer0::UpdateSleep()
 	// clock zero is stopped, REG_OCR0A would keep it at zero?
 	if(!clock || !Reg[REG_OCR0A])
 	{
-		QMutexLocker locker(&Mutex);
-		memset(SleepSequence, 0, sizeof(SleepSequence));
+		SetSequence(NULL);
 		return;
 	}
 	// CTC mode clears when the counter gets to OCR0A, other modes
 	// will use other registers.
-	double duration = SecPerTick(REG_TCCR0B);
 	// ignoring B for now and only using CTC register A
 	uint8_t top=Reg[REG_OCR0A];
 	// mode 0 is normal mode, maximum range
 	if(mode == 0)
 		top = 0xff;
-	// seconds per repitition
-	duration *= top;
 
-	Seq sleep_array[sizeof(SleepSequence)/sizeof(*SleepSequence)]={{{0}}};
+	Seq sleep_array[sizeof(SleepSequence)/sizeof(*SleepSequence)]={{0}};
 	Seq &seq=sleep_array[0];
-	seq.Duration.tv_sec=(long)duration;
-	seq.Duration.tv_nsec=(duration-seq.Duration.tv_sec)*1e9;
-	seq.IrqFlag=_BV(OCF0A);
-	if(Reg[REG_TIMSK] & _BV(OCIE0A))
-		seq.func=CompA;
+	seq.Cycles=CyclesPerTick(REG_TCCR0B)*top;
+	seq.Vector=InterruptController::VectorTimer0CompA;
 
-	{
-		QMutexLocker locker(&Mutex);
-		memcpy(&SleepSequence, &sleep_array, sizeof(SleepSequence));
-		Cond.wakeAll();
-	}
+	SetSequence(sleep_array);
 }
 
 uint8_t Timer0::Get(RegEnum reg)
 {
-	if(reg==REG_TIFR)
-		return Reg[REG_TIFR];
 	if(reg!=REG_TCNT0)
 		return (uint8_t)rand();
 	
 	// calculate the counter TCNT0 value from the elapsed time
-	struct timeval now;
-	gettimeofday(&now, NULL);
 	// This is really only valid if the timer is running and it is
 	// less than or equal to the current TOP.  It can be greater than
 	// top if the sleep is late.
-	return (uint8_t)fmod((now - Start) / SecPerTick(REG_TCCR0B),
-		Reg[REG_OCR0A]);
+	// Without a compare value it counts the full 8 bits.
+	unsigned top=Reg[REG_OCR0A] ? Reg[REG_OCR0A] : 0x100;
+	return (uint8_t)fmod(ElapsedTicks(REG_TCCR0B), top);
 }
@@ -32,7 +32,7 @@ class Timer0 : public Timer
 {
 public:
 	/* reg is a pointer to the current register values. */
-	Timer0(const uint8_t *reg);
+	Timer0(ATtiny *chip, const uint8_t *reg);
 	virtual void Set(RegEnum reg, uint8_t value);
 	virtual uint8_t Get(RegEnum reg);
 protected:
@@ -24,21 +24,13 @@ hardware buttons and LEDs.
 #include "util.h"
 #include <math.h>
 
-Timer1::Timer1(const uint8_t *reg) :
-	Timer(reg, "TIMER1_CAPT_vect", "TIMER1_COMPA_vect", "TIMER1_COMPB_vect",
-		"TIMER1_OVF_vect")
+Timer1::Timer1(ATtiny *chip, const uint8_t *reg) :
+	Timer(chip, reg)
 {
 }
 
 void Timer1::Set(RegEnum reg, uint8_t value)
 {
-	if(reg==REG_TIFR)
-	{
-		// writing 1 clears the flag
-		Reg[REG_TIFR] &= ~value;
-		return;
-	}
-
 	Reg[reg]=value;
 
 	// Writing to the high value of the clock would write to a shared
@@ -52,6 +44,9 @@ void Timer1::Set(RegEnum reg, uint8_t value)
 	case REG_OCR1BH:
 	case REG_ICR1H:
 		return;
+	case REG_TCNT1:
+		SetCounter(REG_TCCR1B, Reg[REG_TCNT1L] | Reg[REG_TCNT1H]<<8);
+		return;
 	default:
 		break;
 	}
@@ -61,9 +56,7 @@ void Timer1::Set(RegEnum reg, uint8_t value)
 
 void Timer1::UpdateSleep()
 {
-	// There isn't currently any way for the timer thread to restart
-	// based on updated registers values.  It will only complete the
-	// current sleep and start the next one.
+	// The new values take effect immediately, see SetSequence.
 	uint8_t mode=
 		((Reg[REG_TCCR1B] & _BV(WGM13))>>1) |
 		((Reg[REG_TCCR1B] & _BV(WGM12))>>1) |
@@ -109,44 +102,28 @@ void Timer1::UpdateSleep()
 	// clock zero is stopped, REG_OCR1A would keep it at zero?
 	if(!clock || (!Reg[REG_OCR1A] && !Reg[REG_OCR1AH]))
 	{
-		QMutexLocker locker(&Mutex);
-		memset(SleepSequence, 0, sizeof(SleepSequence));
+		SetSequence(NULL);
 		return;
 	}
 	// CTC mode clears when the counter gets to OCR1A, other modes
 	// will use other registers.
-	double duration = SecPerTick(REG_TCCR1B);
 	// ignoring B for now and only using CTC register A
 	uint16_t top;
 	memcpy(&top, Reg+REG_OCR1A, sizeof(top));
 	// mode 0 is normal mode, maximum range
 	if(mode == 0)
 		top = 0xffff;
-	// seconds per repitition
-	duration *= top;
-	duration /= 2;
-	//printf("duration %8.6f\n", duration);
 
-	Seq sleep_array[sizeof(SleepSequence)/sizeof(*SleepSequence)]={{{0}}};
+	Seq sleep_array[sizeof(SleepSequence)/sizeof(*SleepSequence)]={{0}};
 	Seq &seq=sleep_array[0];
-	seq.Duration.tv_sec=(long)duration;
-	seq.Duration.tv_nsec=(duration-seq.Duration.tv_sec)*1e9;
-	seq.IrqFlag=_BV(OCF1A);
-	if(Reg[REG_TIMSK] & _BV(OCIE1A))
-		seq.func=CompA;
+	seq.Cycles=CyclesPerTick(REG_TCCR1B)*top/2;
+	seq.Vector=InterruptController::VectorTimer1CompA;
 
-	{
-		QMutexLocker locker(&Mutex);
-		memcpy(&SleepSequence, &sleep_array, sizeof(SleepSequence));
-		Cond.wakeAll();
-	}
+	SetSequence(sleep_array);
 }
 
 uint8_t Timer1::Get(RegEnum reg)
 {
-	if(reg==REG_TIFR)
-		return Reg[REG_TIFR];
-
 	// Reading the low byte will store the high byte to this register.
 	// Reading high will retrieve it, always read the low byte first.
 	if(reg==REG_TCNT1H)
@@ -156,14 +133,14 @@ uint8_t Timer1::Get(RegEnum reg)
 		return (uint8_t)rand();
 	
 	// calculate the counter TCNT1 value from the elapsed time
-	struct timeval now;
-	gettimeofday(&now, NULL);
 	// This is really only valid if the timer is running and it is
 	// less than or equal to the current TOP.  It can be greater than
 	// top if the sleep is late.
-	uint16_t ocr1a=Reg[REG_OCR1AL] | Reg[REG_OCR1AH]<<8;
-	uint16_t counter=(uint16_t)fmod((now - Start) / SecPerTick(REG_TCCR1B),
-		ocr1a);
+	// Without a compare value it counts the full 16 bits.
+	uint32_t top=Reg[REG_OCR1AL] | Reg[REG_OCR1AH]<<8;
+	if(!top)
+		top=0x10000;
+	uint16_t counter=(uint16_t)fmod(ElapsedTicks(REG_TCCR1B), top);
 	Reg[REG_TCNT1H]=counter>>8;
 	return (uint8_t)counter;
 }
@@ -32,7 +32,7 @@ class Timer1 : public Timer
 {
 public:
 	/* reg is a pointer to the current register values. */
-	Timer1(const uint8_t *reg);
+	Timer1(ATtiny *chip, const uint8_t *reg);
 	/* The ATtiny is an 8 bit microcontroller, all register writes are
 	 * 8 bit, even to 16 bit registers.  Write to the high byte (which will
 	 * go into the register array), then the low byte (which will combine
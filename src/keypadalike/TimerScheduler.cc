@@ -0,0 +1,322 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "TimerScheduler.h"
+#include <QMutexLocker>
+#include <algorithm>
+#include <functional>
+#include <unistd.h>
+#include <string.h>
+#include "Timer.h"
+#include "VirtualClock.h"
+#include "InterruptController.h"
+
+TimerScheduler::TimerScheduler(VirtualClock *clock,
+	InterruptController *interrupts) :
+	Clock(clock),
+	Interrupts(interrupts),
+	Order(0),
+	Next(UINT64_MAX),
+	TimerCount(0),
+	Dispatcher(NULL),
+	Stalls(0),
+	Stopping(false),
+	HasStallClock(false),
+	StallClock(CLOCK_MONOTONIC),
+	Policy(CatchUp)
+{
+	for(int i=0; i<MissPolicyCount; ++i)
+		Missed[i]=0;
+	clock_gettime(CLOCK_MONOTONIC, &Base);
+	pthread_mutex_init(&Mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&Cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+TimerScheduler::~TimerScheduler()
+{
+	Stop();
+	pthread_cond_destroy(&Cond);
+	pthread_mutex_destroy(&Mutex);
+}
+
+const char *TimerScheduler::MissPolicyName(MissPolicy policy)
+{
+	switch(policy)
+	{
+	case CatchUp:
+		return "catch-up";
+	case Coalesce:
+		return "coalesce";
+	case Skip:
+		return "skip";
+	default:
+		return NULL;
+	}
+}
+
+bool TimerScheduler::ParseMissPolicy(const char *name, MissPolicy *policy)
+{
+	for(int i=0; i<MissPolicyCount; ++i)
+	{
+		if(!strcmp(name, MissPolicyName((MissPolicy)i)))
+		{
+			*policy=(MissPolicy)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t TimerScheduler::Now()
+{
+	if(Clock->IsEnabled())
+		return Clock->Now();
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t ns=(uint64_t)(now.tv_sec-Base.tv_sec)*1000000000 +
+		now.tv_nsec-Base.tv_nsec;
+	return ns*(VirtualClock::OscillatorHz/1000000)/1000;
+}
+
+struct timespec TimerScheduler::ToTimespec(uint64_t cycles) const
+{
+	uint64_t ns=cycles*1000/(VirtualClock::OscillatorHz/1000000);
+	struct timespec ts;
+	ts.tv_sec=Base.tv_sec+ns/1000000000;
+	ts.tv_nsec=Base.tv_nsec+ns%1000000000;
+	if(ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_nsec-=1000000000;
+		++ts.tv_sec;
+	}
+	return ts;
+}
+
+void TimerScheduler::AddTimer(Timer *timer)
+{
+	int count=TimerCount;
+	Timers[count]=timer;
+	TimerCount=count+1;
+	if(!count)
+		start();
+}
+
+void TimerScheduler::Schedule(Client *client, uint64_t deadline,
+	uint32_t generation)
+{
+	pthread_mutex_lock(&Mutex);
+	// A program rewriting the timer registers faster than the deadlines
+	// come up would otherwise keep growing the heap.
+	if(Heap.size() > 16)
+		locked_Prune(client, generation);
+	Event event={deadline, generation, Order++, client};
+	Heap.push_back(event);
+	std::push_heap(Heap.begin(), Heap.end(), std::greater<Event>());
+	if(deadline < Next)
+		Next=deadline;
+	pthread_cond_signal(&Cond);
+	pthread_mutex_unlock(&Mutex);
+	// with the wall clock a client's events need the thread even
+	// before there is a timer, start does nothing once it runs
+	if(!TimerCount && !Clock->IsEnabled())
+		start();
+}
+
+void TimerScheduler::locked_Prune(Client *client, uint32_t generation)
+{
+	// Only the caller's events are known to be stale, a timer holds
+	// its mutex.
+	size_t j=0;
+	for(size_t i=0; i<Heap.size(); ++i)
+	{
+		if(Heap[i].Obj==client && Heap[i].Generation!=generation)
+			continue;
+		Heap[j++]=Heap[i];
+	}
+	Heap.resize(j);
+	std::make_heap(Heap.begin(), Heap.end(), std::greater<Event>());
+}
+
+bool TimerScheduler::PopDue(uint64_t target, Event *event)
+{
+	if(Heap.empty() || Heap.front().Deadline > target)
+		return false;
+	std::pop_heap(Heap.begin(), Heap.end(), std::greater<Event>());
+	*event=Heap.back();
+	Heap.pop_back();
+	return true;
+}
+
+void TimerScheduler::run()
+{
+	if(Clock->IsEnabled())
+		RunStallDetect();
+	else
+		RunWallClock();
+}
+
+void TimerScheduler::Stop()
+{
+	pthread_mutex_lock(&Mutex);
+	Stopping=true;
+	pthread_cond_signal(&Cond);
+	pthread_mutex_unlock(&Mutex);
+	wait();
+}
+
+void TimerScheduler::RunWallClock()
+{
+	pthread_mutex_lock(&Mutex);
+	while(!Stopping)
+	{
+		if(Heap.empty())
+		{
+			pthread_cond_wait(&Cond, &Mutex);
+			continue;
+		}
+		Event event;
+		if(!PopDue(Now(), &event))
+		{
+			// woken early when an earlier deadline is scheduled
+			struct timespec ts=ToTimespec(Heap.front().Deadline);
+			pthread_cond_timedwait(&Cond, &Mutex, &ts);
+			continue;
+		}
+		pthread_mutex_unlock(&Mutex);
+		event.Obj->Expire(event.Generation);
+		pthread_mutex_lock(&Mutex);
+	}
+	pthread_mutex_unlock(&Mutex);
+}
+
+void TimerScheduler::SetStallClock(clockid_t clock)
+{
+	StallClock=clock;
+	HasStallClock=true;
+}
+
+void TimerScheduler::AfterFork()
+{
+	// the thread is started with the first timer
+	if(!TimerCount || !Clock->IsEnabled())
+		return;
+	pthread_t thread;
+	if(!pthread_create(&thread, NULL, StallDetectThread, this))
+		pthread_detach(thread);
+}
+
+void* TimerScheduler::StallDetectThread(void *scheduler)
+{
+	((TimerScheduler*)scheduler)->RunStallDetect();
+	return NULL;
+}
+
+uint64_t TimerScheduler::StallTime() const
+{
+	struct timespec ts;
+	clock_gettime(HasStallClock ? StallClock : CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void TimerScheduler::RunStallDetect()
+{
+	uint32_t last=Clock->GetProgress();
+	uint64_t start=StallTime();
+	while(!Stopping)
+	{
+		usleep(StallUs);
+		uint32_t progress=Clock->GetProgress();
+		if(progress != last)
+		{
+			last=progress;
+			start=StallTime();
+			continue;
+		}
+		uint64_t next=Next;
+		if(next == UINT64_MAX || StallTime()-start < StallUs)
+			continue;
+		++Stalls;
+		RunUntil(std::max(next, Clock->Now()));
+		last=Clock->GetProgress();
+		start=StallTime();
+	}
+}
+
+void TimerScheduler::RunExclusive(Client *client)
+{
+	QThread *self=QThread::currentThread();
+	// already running the events
+	if(Dispatcher == self)
+	{
+		client->Expire(0);
+		return;
+	}
+	QMutexLocker locker(&DispatchMutex);
+	Dispatcher=self;
+	client->Expire(0);
+	Dispatcher=NULL;
+}
+
+void TimerScheduler::RunUntil(uint64_t target)
+{
+	QThread *self=QThread::currentThread();
+	if(Dispatcher == self)
+	{
+		// Called from an interrupt handler executed from here, the
+		// events will be run when the handler returns.
+		Clock->AdvanceTo(target);
+		return;
+	}
+
+	QMutexLocker locker(&DispatchMutex);
+	Dispatcher=self;
+	for(;;)
+	{
+		// An interrupt that couldn't run because interrupts were
+		// disabled is tried again before every event, and on every
+		// charge while it is still pending.
+		bool pending=Interrupts->Dispatch();
+
+		Event event;
+		pthread_mutex_lock(&Mutex);
+		bool due=PopDue(target, &event);
+		if(!due)
+		{
+			if(pending)
+				Next=0;
+			else
+				Next=Heap.empty() ? UINT64_MAX :
+					Heap.front().Deadline;
+		}
+		pthread_mutex_unlock(&Mutex);
+		if(!due)
+			break;
+		Clock->AdvanceTo(event.Deadline);
+		event.Obj->Expire(event.Generation);
+	}
+	Clock->AdvanceTo(target);
+	Dispatcher=NULL;
+}
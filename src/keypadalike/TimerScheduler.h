@@ -0,0 +1,207 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TIMER_SCHEDULER_H
+#define _TIMER_SCHEDULER_H
+
+#include <QThread>
+#include <QMutex>
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+
+class Timer;
+class VirtualClock;
+class InterruptController;
+
+/* One thread runs the events of every timer.  Each timer schedules the
+ * deadline of its next compare match or overflow here, the earliest is
+ * kept at the top of a heap and the thread sleeps until it is due, then
+ * calls Timer::Expire which runs the interrupt and schedules the next one.
+ *
+ * All deadlines are in cycles of the 8 MHz internal oscillator, the same
+ * as VirtualClock.  With the wall clock the cycles are counted from when
+ * this object was created using CLOCK_MONOTONIC.
+ *
+ * A register write that changes a timer schedules a new deadline right
+ * away with a new generation number for that timer, the events still in
+ * the heap from an older generation are dropped when they come up.
+ *
+ * With virtual time the events are instead run by RunUntil from whatever
+ * thread moves the time, and the thread here only does stall detection,
+ * see VirtualClock.
+ *
+ * Besides the timers a Client can schedule its own events, such as
+ * scripted button input at an exact time.
+ */
+class TimerScheduler : public QThread
+{
+public:
+	enum
+	{
+		// virtual time, microseconds without progress to be a stall
+		StallUs=100
+	};
+	/* With the wall clock each deadline is the previous deadline plus
+	 * the period, so the handler run time and wakeup latency don't
+	 * add up.  When the scheduler falls so far behind that the
+	 * following deadline has also passed, the missed interrupts are
+	 * either run back to back (CatchUp), run once for all of them
+	 * (Coalesce, like the single flag bit in the hardware), or
+	 * dropped until the next deadline in the future (Skip).
+	 */
+	enum MissPolicy
+	{
+		CatchUp,
+		Coalesce,
+		Skip,
+		MissPolicyCount
+	};
+	// Something run at a deadline, Timer is one.
+	class Client
+	{
+	public:
+		virtual ~Client() {}
+		/* Called when the deadline scheduled with generation is
+		 * reached, from the thread moving the time with virtual
+		 * time.
+		 */
+		virtual void Expire(uint32_t generation) = 0;
+	};
+	// interrupts runs the pending handlers with virtual time
+	TimerScheduler(VirtualClock *clock, InterruptController *interrupts);
+	// stops the thread
+	~TimerScheduler();
+	// current time in oscillator cycles
+	uint64_t Now();
+	// Add a timer, the thread is started with the first one.
+	void AddTimer(Timer *timer);
+	/* Run client's Expire(generation) when the time reaches deadline,
+	 * with the wall clock this also starts the thread.
+	 */
+	void Schedule(Client *client, uint64_t deadline, uint32_t generation);
+	// Stop the thread and wait for it, no more events are run by it.
+	void Stop();
+
+	// Virtual time, the earliest deadline, 0 if an interrupt is
+	// pending, or UINT64_MAX if there aren't any events.
+	uint64_t NextDeadline() const { return Next; }
+	// Virtual time, run events in order until the time reaches target.
+	void RunUntil(uint64_t target);
+	/* Virtual time, run client's Expire(0) on the calling thread with
+	 * no events running on another thread, as if it were due now.
+	 */
+	void RunExclusive(Client *client);
+	// The number of times the time was moved forward because the
+	// program wasn't making any progress.
+	uint32_t GetStalls() const { return Stalls; }
+
+	void SetMissPolicy(MissPolicy policy) { Policy=policy; }
+	MissPolicy GetMissPolicy() const { return Policy; }
+	// Add count interrupts that were handled late by policy.
+	void CountMissed(MissPolicy policy, uint32_t count)
+	{
+		Missed[policy]+=count;
+	}
+	// interrupts handled with policy since the start
+	uint32_t GetMissed(MissPolicy policy) const { return Missed[policy]; }
+	static const char *MissPolicyName(MissPolicy policy);
+	// Find the policy with name, returns false if there isn't one.
+	static bool ParseMissPolicy(const char *name, MissPolicy *policy);
+	/* The CPU time clock of the program's main thread.  Once set a
+	 * stall is StallUs of its CPU time without progress instead of
+	 * wall clock time, a main thread waiting for a CPU (with many
+	 * chips in one process) isn't a busy wait.
+	 */
+	void SetStallClock(clockid_t clock);
+	/* In a child forked from the thread moving the virtual time, only
+	 * that thread is there, start another stall detector in place of
+	 * the thread here.  Nothing for the wall clock.
+	 */
+	void AfterFork();
+protected:
+	void run();
+private:
+	struct Event
+	{
+		uint64_t Deadline;
+		uint32_t Generation;
+		// events with the same deadline run in the order scheduled
+		uint32_t Order;
+		Client *Obj;
+		bool operator>(const Event &e) const
+		{
+			if(Deadline != e.Deadline)
+				return Deadline > e.Deadline;
+			return Order > e.Order;
+		}
+	};
+	void RunWallClock();
+	void RunStallDetect();
+	// pthread entry for AfterFork
+	static void* StallDetectThread(void *scheduler);
+	// microseconds of the stall clock
+	uint64_t StallTime() const;
+	// Pop the earliest event into event if it is due by target.
+	bool PopDue(uint64_t target, Event *event);
+	// Drop events from older generations of client.
+	void locked_Prune(Client *client, uint32_t generation);
+	// absolute CLOCK_MONOTONIC time of cycles
+	struct timespec ToTimespec(uint64_t cycles) const;
+
+	VirtualClock *Clock;
+	InterruptController *Interrupts;
+	struct timespec Base;
+
+	/* QWaitCondition only takes a relative timeout in milliseconds,
+	 * much too coarse for the timer periods, a pthread condition
+	 * variable on CLOCK_MONOTONIC waits until an absolute time and
+	 * is signaled when an earlier deadline is scheduled.
+	 */
+	pthread_mutex_t Mutex;
+	pthread_cond_t Cond;
+	// min heap ordered by Event::operator>
+	std::vector<Event> Heap;
+	uint32_t Order;
+	std::atomic<uint64_t> Next;
+
+	// Timers are only added, the count is set after the pointer.
+	Timer *Timers[2];
+	std::atomic<int> TimerCount;
+
+	// Virtual time, held while running events.  The thread running
+	// them, a register access from an interrupt handler only adds to
+	// the time.
+	QMutex DispatchMutex;
+	std::atomic<QThread*> Dispatcher;
+	std::atomic<uint32_t> Stalls;
+	std::atomic<bool> Stopping;
+	// set after StallClock
+	std::atomic<bool> HasStallClock;
+	clockid_t StallClock;
+	MissPolicy Policy;
+	std::atomic<uint32_t> Missed[MissPolicyCount];
+};
+
+#endif // _TIMER_SCHEDULER_H
@@ -0,0 +1,314 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ToneOscillator.h"
+#include "ATtiny.h"
+#include "ATtinyChip.h"
+#include "PinBus.h"
+#include "Timer1.h"
+
+ToneOscillator::ToneOscillator(ATtiny *chip, ATtinyChip *registers,
+	PinBus *bus) :
+	Chip(chip),
+	Registers(registers),
+	Bus(bus),
+	Timer(NULL),
+	Enabled(true),
+	Asleep(false),
+	Streak(0),
+	Mask(0),
+	Round(false),
+	RoundWoke(false),
+	RoundClean(false),
+	Toggles(0),
+	RoundHash(0),
+	Running(false),
+	Rechecking(false),
+	Stride(1),
+	Applied(0),
+	Pins(0),
+	Hash(0)
+{
+	Counts.Started=0;
+	Counts.Synthesized=0;
+	Counts.Verified=0;
+}
+
+void ToneOscillator::Enable(bool enable)
+{
+	if(!enable)
+		Stop();
+	Enabled=enable;
+	Streak=0;
+	Round=false;
+}
+
+void ToneOscillator::HandlerStart(InterruptController::Vector vector)
+{
+	if(!Enabled)
+		return;
+	if(vector!=InterruptController::VectorTimer1CompA)
+	{
+		// not one to check
+		Round=false;
+		return;
+	}
+	// A woken main thread can take longer than the next deadline with
+	// the wall clock, the check continues until it sleeps.
+	if(!Round)
+	{
+		Round=true;
+		RoundWoke=Asleep;
+		RoundClean=Chip->ProgramHash(&RoundHash);
+	}
+	Toggles=0;
+}
+
+void ToneOscillator::HandlerEnd(InterruptController::Vector vector)
+{
+	if(!Enabled || vector==InterruptController::VectorReset)
+		return;
+	if(vector!=InterruptController::VectorTimer1CompA)
+	{
+		// the main thread wakes up for it, even if it hasn't yet
+		Asleep=false;
+		uint64_t hash;
+		if(Running && !Rechecking &&
+			(!Chip->ProgramHash(&hash) || hash!=Hash))
+			Recheck();
+		return;
+	}
+	if(!Round)
+		return;
+	if(Toggles!=1)
+		EndRound(false);
+	else if(!RoundWoke)
+		EndRound(true);
+}
+
+bool ToneOscillator::ChangesTimer(RegEnum reg, RegOp op, uint8_t value)
+{
+	switch(reg)
+	{
+	case REG_TIFR:
+	case REG_TCNT1L:
+	case REG_TCNT1H:
+		return true;
+	case REG_TCCR1A:
+	case REG_TCCR1B:
+	case REG_TCCR1C:
+	case REG_OCR1AL:
+	case REG_OCR1AH:
+	case REG_TIMSK:
+	case REG_CLKPR:
+	{
+		uint8_t v=Registers->Storage(reg);
+		return RegApply(op, v, value)!=v;
+	}
+	default:
+		return false;
+	}
+}
+
+void ToneOscillator::Write(RegEnum reg, RegOp op, uint8_t value)
+{
+	if(!Enabled)
+		return;
+	if(InterruptController::Current()==
+		InterruptController::VectorTimer1CompA)
+	{
+		if(reg==REG_PORTD && op==REG_OP_XOR && value &&
+			!(value & ~SpeakerPins) && (!Running || value==Mask))
+		{
+			if(value!=Mask)
+			{
+				Mask=value;
+				Streak=0;
+			}
+			++Toggles;
+			return;
+		}
+		// stopped before the write is applied
+		EndRound(false);
+		return;
+	}
+	Busy();
+	if(ChangesTimer(reg, op, value))
+	{
+		Streak=0;
+		Stop();
+	}
+	if(Running && reg==REG_PORTD)
+	{
+		Update();
+		Pins=Registers->Storage(REG_PORTD) & Mask;
+	}
+}
+
+void ToneOscillator::Read(RegEnum reg)
+{
+	if(!Enabled)
+		return;
+	if(InterruptController::Current()==
+		InterruptController::VectorTimer1CompA)
+		EndRound(false);
+	// sleep_cpu reads MCUCR
+	else if(reg!=REG_MCUCR)
+		Busy();
+	if(Running && reg==REG_PORTD)
+		Update();
+}
+
+void ToneOscillator::Activity()
+{
+	if(Enabled && InterruptController::Current()!=
+		InterruptController::VectorTimer1CompA)
+		Busy();
+}
+
+void ToneOscillator::Busy()
+{
+	if(Round && RoundWoke && !InterruptController::InHandler())
+		EndRound(false);
+}
+
+void ToneOscillator::PortWritten()
+{
+	if(!Running || InterruptController::Current()==
+		InterruptController::VectorTimer1CompA)
+		return;
+	std::atomic<uint8_t> &portd=Registers->Storage(REG_PORTD);
+	uint8_t pins=portd & Mask;
+	if(pins==Pins)
+		return;
+	/* The pins from before the last toggle were written back, the
+	 * program read PORTD with interrupts disabled and the hardware
+	 * would run the handler after, toggling them again.  Anything else
+	 * is the program setting the speaker.
+	 */
+	if(pins==(Pins ^ Mask))
+		portd^=Mask;
+	else
+		Stop();
+}
+
+void ToneOscillator::Sleeping()
+{
+	if(!Enabled)
+		return;
+	if(Round && RoundWoke)
+	{
+		EndRound(true);
+	}
+	else if(Running && !Rechecking)
+	{
+		uint64_t hash;
+		if(!Chip->ProgramHash(&hash) || hash!=Hash)
+			Recheck();
+	}
+	Asleep=true;
+}
+
+void ToneOscillator::EndRound(bool clean)
+{
+	uint64_t hash;
+	clean=clean && RoundClean && Chip->ProgramHash(&hash) &&
+		hash==RoundHash;
+	Round=false;
+	if(!clean)
+	{
+		Streak=0;
+		Stop();
+		return;
+	}
+	Hash=RoundHash;
+	if(Running)
+	{
+		++Counts.Verified;
+		if(Rechecking)
+		{
+			Rechecking=false;
+			Timer->SetStride(Stride);
+		}
+		return;
+	}
+	if(++Streak >= LearnRounds)
+		Start();
+}
+
+ToneOscillator::Stats ToneOscillator::GetStats()
+{
+	// count the toggles up to now
+	if(Running)
+		Update();
+	return Counts;
+}
+
+void ToneOscillator::Update()
+{
+	uint64_t skipped=Timer->Skipped(Chip->Scheduler().Now());
+	if((skipped-Applied) & 1)
+		Registers->Storage(REG_PORTD)^=Mask;
+	Counts.Synthesized+=skipped-Applied;
+	Applied=skipped;
+}
+
+void ToneOscillator::Recheck()
+{
+	Rechecking=true;
+	Timer->SetStride(1);
+}
+
+void ToneOscillator::Start()
+{
+	uint64_t end, cycles;
+	if(!Timer || !Mask || !Timer->Deadline(&end, &cycles))
+		return;
+	uint64_t stride=(uint64_t)VirtualClock::OscillatorHz*VerifyMs/1000/
+		cycles;
+	// too slow to be worth it
+	if(stride < 2)
+		return;
+	Running=true;
+	Rechecking=false;
+	Stride=stride;
+	Timer->SetStride(Stride);
+	Applied=Timer->Skipped(Chip->Scheduler().Now());
+	++Counts.Started;
+	// the deadline at end and the ones after it toggle the speaker
+	Bus->Toggle(PinBus::PortD, Mask, end, cycles);
+}
+
+void ToneOscillator::Stop()
+{
+	if(!Running)
+		return;
+	// the skipped deadlines that passed are final once it's back to 1
+	Timer->SetStride(1);
+	Update();
+	Running=false;
+	Rechecking=false;
+	Registers->FlushPorts();
+	Bus->Write(REG_PORTD, Registers->Storage(REG_PORTD) &
+		Registers->Storage(REG_DDRD));
+	Bus->Toggle(PinBus::PortD, 0, 0, 0);
+}
@@ -0,0 +1,144 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TONE_OSCILLATOR_H
+#define _TONE_OSCILLATOR_H
+
+#include <avr/io.h>
+#include <stdint.h>
+#include "InterruptController.h"
+
+class ATtiny;
+class ATtinyChip;
+class PinBus;
+class Timer1;
+
+/* A tone is played with a TIMER1_COMPA_vect handler that only toggles the
+ * speaker pins.  At kHz rates each run costs a timer event, a handoff to
+ * the handler, and waking the sleeping main loop, which only goes back to
+ * sleep.  Once the handler has been seen doing just that LearnRounds
+ * times in a row the oscillator takes over, Timer1 only runs every
+ * Stride-th deadline (about VerifyMs apart), PORTD has the toggles of the
+ * skipped deadlines added when it is accessed, and the speaker is given
+ * the tone's period instead of each edge.
+ *
+ * A handler run is clean when it does one PORTD ^= of the speaker pins
+ * and nothing else, the program's globals are the same afterwards, and a
+ * main thread it woke goes back to sleep without touching a register.
+ * The deadlines still run are checked the same way.  Another handler or
+ * the main thread changing the globals makes the next deadline run, in
+ * case it changed what the handler does.  It stops when a check fails,
+ * the program changes Timer1, TIMSK, TIFR, or the clock, or it sets the
+ * speaker pins itself.
+ *
+ * Owned by ATtinyChip, all calls are made with the ATtiny lock held.
+ */
+class ToneOscillator
+{
+public:
+	enum
+	{
+		// clean handler runs in a row before taking over
+		LearnRounds=16,
+		// about how often the handler still runs, milliseconds
+		VerifyMs=10,
+		SpeakerPins=_BV(PD1) | _BV(PD6)
+	};
+	struct Stats
+	{
+		// times it took over
+		uint64_t Started;
+		// speaker toggles made without running the handler
+		uint64_t Synthesized;
+		// handler runs checked while it was running
+		uint64_t Verified;
+	};
+	// chip is for the program's globals, registers and bus are its chip's
+	ToneOscillator(ATtiny *chip, ATtinyChip *registers, PinBus *bus);
+	// on by default, disabling stops it
+	void Enable(bool enable);
+	// once the chip creates Timer1
+	void SetTimer(Timer1 *timer) { Timer=timer; }
+
+	// An interrupt handler is about to run, or has returned.
+	void HandlerStart(InterruptController::Vector vector);
+	void HandlerEnd(InterruptController::Vector vector);
+	// The program is about to write or read reg.
+	void Write(RegEnum reg, RegOp op, uint8_t value);
+	void Read(RegEnum reg);
+	// The program did something else that takes time, such as a delay.
+	void Activity();
+	// PORTD was written, called after it is applied.
+	void PortWritten();
+	// The main thread is going to sleep, or woke up.
+	void Sleeping();
+	void Woke() { Asleep=false; }
+	// Give the toggling back to the handler, PORTD is brought up to date.
+	void Stop();
+	Stats GetStats();
+private:
+	// The main thread or another handler did something, fails a check
+	// waiting on the main thread.
+	void Busy();
+	// Writing reg with op and value changes how the handler is run.
+	bool ChangesTimer(RegEnum reg, RegOp op, uint8_t value);
+	// The check of the handler run is done.
+	void EndRound(bool clean);
+	// Add the toggles of the deadlines skipped since the last update.
+	void Update();
+	// Run the next deadline, the globals changed since the last check.
+	void Recheck();
+	void Start();
+
+	ATtiny *Chip;
+	ATtinyChip *Registers;
+	PinBus *Bus;
+	Timer1 *Timer;
+	bool Enabled;
+	// the main thread is in sleep_cpu
+	bool Asleep;
+
+	// clean handler runs in a row, and the pins they toggled
+	int Streak;
+	uint8_t Mask;
+	// The handler run being checked, it woke the main thread, if it is
+	// still clean, its toggles, and the globals from before.
+	bool Round;
+	bool RoundWoke;
+	bool RoundClean;
+	int Toggles;
+	uint64_t RoundHash;
+
+	bool Running;
+	// running every deadline until one checks clean
+	bool Rechecking;
+	uint32_t Stride;
+	// Timer1 skipped deadlines already toggled in PORTD
+	uint64_t Applied;
+	// speaker pins before a write by the program, see PortWritten
+	uint8_t Pins;
+	// the globals at the last clean run
+	uint64_t Hash;
+	Stats Counts;
+};
+
+#endif // _TONE_OSCILLATOR_H
@@ -0,0 +1,63 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "VirtualClock.h"
+
+VirtualClock::VirtualClock() :
+	Enabled(false),
+	Scheduler(NULL),
+	Cycles(0),
+	Progress(0),
+	CpuDivide(8) // 1 MHz default system clock
+{
+}
+
+void VirtualClock::Enable()
+{
+	Enabled=true;
+}
+
+void VirtualClock::Delay(double sec)
+{
+	++Progress;
+	Scheduler->RunUntil(Cycles+FromSeconds(sec));
+}
+
+bool VirtualClock::Idle()
+{
+	uint64_t next=Scheduler->NextDeadline();
+	if(next==UINT64_MAX)
+		return false;
+	++Progress;
+	uint64_t now=Cycles;
+	Scheduler->RunUntil(next > now ? next : now);
+	return true;
+}
+
+void VirtualClock::AdvanceTo(uint64_t cycles)
+{
+	// Another thread can be charging at the same time, and a late event
+	// (from a delay in an interrupt handler) doesn't move the time back.
+	uint64_t now=Cycles;
+	while(now < cycles && !Cycles.compare_exchange_weak(now, cycles))
+		;
+}
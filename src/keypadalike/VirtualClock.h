@@ -0,0 +1,105 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _VIRTUAL_CLOCK_H
+#define _VIRTUAL_CLOCK_H
+
+#include <atomic>
+#include <stdint.h>
+#include "TimerScheduler.h"
+
+/* By default the emulation runs against the wall clock, the timers sleep
+ * and _delay_ms sleeps.  When enabled this class replaces the wall clock
+ * with a single emulated cycle counter.  Time only moves forward when the
+ * program executes a delay or accesses a register (charged a few cycles
+ * each), and the timer events are executed from whatever thread moves the
+ * time past their deadline, so a program runs as fast as the host allows
+ * and gives the same result every run.
+ *
+ * All times are in cycles of the 8 MHz internal oscillator, which doesn't
+ * change when CLKPR divides down the system clock.
+ *
+ * A program that busy waits on a variable set by an interrupt without
+ * touching a register never moves the time forward.  The TimerScheduler
+ * thread watches the progress count for that and moves the time to the
+ * next timer event when there hasn't been any progress for a while.
+ * Those programs still run, but the result is only as deterministic as
+ * the amount of work done between register accesses.
+ */
+class VirtualClock
+{
+public:
+	enum
+	{
+		OscillatorHz=8000000
+	};
+	VirtualClock();
+	// Switch from the wall clock to virtual time, call before the
+	// program starts running.
+	void Enable();
+	bool IsEnabled() const { return Enabled; }
+	// The timer events are run from scheduler.
+	void SetScheduler(TimerScheduler *scheduler) { Scheduler=scheduler; }
+	// current time in oscillator cycles
+	uint64_t Now() const { return Cycles; }
+	// Oscillator cycles for each system clock cycle from CLKPR.
+	void SetCpuDivide(uint32_t divide) { CpuDivide=divide; }
+	static uint64_t FromSeconds(double sec)
+	{
+		return (uint64_t)(sec*OscillatorHz + .5);
+	}
+	static double ToSeconds(uint64_t cycles)
+	{
+		return (double)cycles/OscillatorHz;
+	}
+
+	// The program executed cpu_cycles system clock cycles.  Runs any
+	// timer events that are now due.
+	void Charge(uint32_t cpu_cycles)
+	{
+		if(!Enabled)
+			return;
+		uint64_t now=Cycles+=(uint64_t)cpu_cycles*CpuDivide;
+		++Progress;
+		if(now >= Scheduler->NextDeadline())
+			Scheduler->RunUntil(now);
+	}
+	// Move the time forward by sec seconds, running any timer events
+	// along the way, used in place of sleeping.
+	void Delay(double sec);
+	/* The CPU is sleeping, move the time to the next timer event and
+	 * run it.  Returns false if there isn't one.
+	 */
+	bool Idle();
+	// Move the time forward to cycles if it isn't already past it.
+	void AdvanceTo(uint64_t cycles);
+	// Incremented on every charge or delay.
+	uint32_t GetProgress() const { return Progress; }
+private:
+	bool Enabled;
+	TimerScheduler *Scheduler;
+	std::atomic<uint64_t> Cycles;
+	std::atomic<uint32_t> Progress;
+	uint32_t CpuDivide;
+};
+
+#endif // _VIRTUAL_CLOCK_H
@@ -20,256 +20,112 @@ hardware buttons and LEDs.
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <iostream>
 #include <avr/io.h>
 #include "ATtiny.h"
 
-using namespace std;
+RegObj<REG_PIND> PIND;
+RegObj<REG_DDRD> DDRD;
+RegObj<REG_PORTD> PORTD;
 
-RegObj PIND(REG_PIND);
-RegObj DDRD(REG_DDRD);
-RegObj PORTD(REG_PORTD);
+RegObj<REG_PINB> PINB;
+RegObj<REG_DDRB> DDRB;
+RegObj<REG_PORTB> PORTB;
 
-RegObj PINB(REG_PINB);
-RegObj DDRB(REG_DDRB);
-RegObj PORTB(REG_PORTB);
+RegObj<REG_PINA> PINA;
+RegObj<REG_DDRA> DDRA;
+RegObj<REG_PORTA> PORTA;
 
-RegObj PINA(REG_PINA);
-RegObj DDRA(REG_DDRA);
-RegObj PORTA(REG_PORTA);
+RegObj<REG_CLKPR> CLKPR;
 
-RegObj CLKPR(REG_CLKPR);
-
-RegObj MCUSR(REG_MCUSR);
-RegObj WDTCSR(REG_WDTCSR);
+RegObj<REG_MCUSR> MCUSR;
+RegObj<REG_WDTCSR> WDTCSR;
+RegObj<REG_MCUCR> MCUCR;
 
 // Timer 0
-RegObj TCCR0A(REG_TCCR0A);
-RegObj TCCR0B(REG_TCCR0B);
-RegObj TCNT0(REG_TCNT0);
-RegObj OCR0A(REG_OCR0A);
-RegObj OCR0B(REG_OCR0B);
-RegObj TIMSK(REG_TIMSK);
-RegObj TIFR(REG_TIFR);
-
-RegObj TCCR1A(REG_TCCR1A);
-RegObj TCCR1B(REG_TCCR1B);
-RegObj TCCR1C(REG_TCCR1C);
-RegObj16 TCNT1(REG_TCNT1);
-RegObj TCNT1L(REG_TCNT1L);
-RegObj TCNT1H(REG_TCNT1H);
-RegObj16 OCR1A(REG_OCR1A);
-RegObj OCR1AL(REG_OCR1AL);
-RegObj OCR1AH(REG_OCR1AH);
-RegObj16 OCR1B(REG_OCR1B);
-RegObj OCR1BL(REG_OCR1BL);
-RegObj OCR1BH(REG_OCR1BH);
-RegObj16 ICR1(REG_ICR1);
-RegObj ICR1L(REG_ICR1L);
-RegObj ICR1H(REG_ICR1H);
+RegObj<REG_TCCR0A> TCCR0A;
+RegObj<REG_TCCR0B> TCCR0B;
+RegObj<REG_TCNT0> TCNT0;
+RegObj<REG_OCR0A> OCR0A;
+RegObj<REG_OCR0B> OCR0B;
+RegObj<REG_TIMSK> TIMSK;
+RegObj<REG_TIFR> TIFR;
+
+RegObj<REG_TCCR1A> TCCR1A;
+RegObj<REG_TCCR1B> TCCR1B;
+RegObj<REG_TCCR1C> TCCR1C;
+RegObj16<REG_TCNT1> TCNT1;
+RegObj<REG_TCNT1L> TCNT1L;
+RegObj<REG_TCNT1H> TCNT1H;
+RegObj16<REG_OCR1A> OCR1A;
+RegObj<REG_OCR1AL> OCR1AL;
+RegObj<REG_OCR1AH> OCR1AH;
+RegObj16<REG_OCR1B> OCR1B;
+RegObj<REG_OCR1BL> OCR1BL;
+RegObj<REG_OCR1BH> OCR1BH;
+RegObj16<REG_ICR1> ICR1;
+RegObj<REG_ICR1L> ICR1L;
+RegObj<REG_ICR1H> ICR1H;
 
 RegObj_SREG SREG;
 
-RegObj& RegObj::operator=(uint8_t value)
-{
-	g_ATtiny=RegValue(Reg, value);
-	return *this;
-}
-
-RegObj& RegObj::operator+=(uint8_t value)
-{
-	g_ATtiny+=RegValue(Reg, value);
-	return *this;
-}
-
-RegObj& RegObj::operator-=(uint8_t value)
-{
-	g_ATtiny-=RegValue(Reg, value);
-	return *this;
-}
-
-RegObj& RegObj::operator|=(uint8_t value)
+void RegPortWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value)
 {
-	g_ATtiny|=RegValue(Reg, value);
-	return *this;
+	chip->Set(&ATtinyChip::SetPort, reg, op, value);
 }
 
-RegObj& RegObj::operator&=(uint8_t value)
+void RegTimer0Write(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value)
 {
-	g_ATtiny&=RegValue(Reg, value);
-	return *this;
+	chip->Set(&ATtinyChip::SetTimer0, reg, op, value);
 }
 
-RegObj& RegObj::operator^=(uint8_t value)
+void RegTimer1Write(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value)
 {
-	g_ATtiny^=RegValue(Reg, value);
-	return *this;
+	chip->Set(&ATtinyChip::SetTimer1, reg, op, value);
 }
 
-RegObj& RegObj::operator++()
+void RegTimersWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value)
 {
-	*this+=1;
-	return *this;
+	chip->Set(&ATtinyChip::SetTimers, reg, op, value);
+	// a flag can already be pending when TIMSK enables it
+	chip->Interrupts().Dispatch();
 }
 
-RegObj& RegObj::operator--()
+void RegClockWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value)
 {
-	*this-=1;
-	return *this;
-}
-
-RegObj::operator uint8_t()
-{
-	return g_ATtiny.GetValue(Reg);
+	chip->Set(&ATtinyChip::SetClock, reg, op, value);
 }
 
 // enable or disable the interrupts when the value changes
-RegObj_SREG& RegObj_SREG::operator=(uint8_t value)
-{
-	uint8_t before=g_ATtiny.GetValue(Reg);
-	g_ATtiny=RegValue(Reg, value);
-	uint8_t after=g_ATtiny.GetValue(Reg);
-	if((before ^ after) & _BV(SREG_I))
-		g_ATtiny.EnableInterrupts(after & _BV(SREG_I));
-	return *this;
-}
-
-RegObj_SREG& RegObj_SREG::operator|=(uint8_t value)
-{
-	uint8_t before=g_ATtiny.GetValue(Reg);
-	g_ATtiny|=RegValue(Reg, value);
-	uint8_t after=g_ATtiny.GetValue(Reg);
-	if((before ^ after) & _BV(SREG_I))
-		g_ATtiny.EnableInterrupts(after & _BV(SREG_I));
-	return *this;
-}
-
-RegObj_SREG& RegObj_SREG::operator&=(uint8_t value)
-{
-	uint8_t before=g_ATtiny.GetValue(Reg);
-	g_ATtiny&=RegValue(Reg, value);
-	uint8_t after=g_ATtiny.GetValue(Reg);
-	if((before ^ after) & _BV(SREG_I))
-		g_ATtiny.EnableInterrupts(after & _BV(SREG_I));
-	return *this;
-}
-
-RegObj_SREG& RegObj_SREG::operator^=(uint8_t value)
-{
-	uint8_t before=g_ATtiny.GetValue(Reg);
-	g_ATtiny^=RegValue(Reg, value);
-	uint8_t after=g_ATtiny.GetValue(Reg);
-	if((before ^ after) & _BV(SREG_I))
-		g_ATtiny.EnableInterrupts(after & _BV(SREG_I));
-	return *this;
-}
-
-RegObj_SREG::operator uint8_t()
-{
-	return g_ATtiny.GetValue(Reg);
-}
-
-/* From 16-bit Timer/Counter1 "Accessing 16-bit Registers"
- * "To do a 16-bit write, the high byte must be written before the low byte.
- * For a 16-bit read, the low byte must be read before the high byte."
- */
-RegObj16& RegObj16::operator=(uint16_t value)
-{
-	g_ATtiny=RegValue(RegH, value>>8);
-	g_ATtiny=RegValue(Reg, value);
-	return *this;
-}
-
-RegObj16& RegObj16::operator+=(uint16_t value)
-{
-	// split into read, modify, write
-	// So it is read low, read high, modify, write high, write low,
-	// to execute the operations in the documented order.
-	uint16_t v16=*this;
-	v16+=value;
-	*this=v16;
-	return *this;
-}
-
-RegObj16& RegObj16::operator-=(uint16_t value)
-{
-	// split into read, modify, write
-	// So it is read low, read high, modify, write high, write low,
-	// to execute the operations in the documented order.
-	uint16_t v16=*this;
-	v16-=value;
-	*this=v16;
-	return *this;
-}
-
-RegObj16& RegObj16::operator|=(uint16_t value)
-{
-	// split into read, modify, write
-	// So it is read low, read high, modify, write high, write low,
-	// to execute the operations in the documented order.
-	uint16_t v16=*this;
-	v16|=value;
-	*this=v16;
-	return *this;
-}
-
-RegObj16& RegObj16::operator&=(uint16_t value)
+void RegSREGWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value)
 {
-	// split into read, modify, write
-	// So it is read low, read high, modify, write high, write low,
-	// to execute the operations in the documented order.
-	uint16_t v16=*this;
-	v16&=value;
-	*this=v16;
-	return *this;
+	chip->SetSREG(op, value);
+	// the I bit could have been set
+	chip->Interrupts().Dispatch();
 }
 
-RegObj16& RegObj16::operator^=(uint16_t value)
+void RegOtherWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value)
 {
-	// split into read, modify, write
-	// So it is read low, read high, modify, write high, write low,
-	// to execute the operations in the documented order.
-	uint16_t v16=*this;
-	v16^=value;
-	*this=v16;
-	return *this;
+	chip->Set(&ATtinyChip::SetOther, reg, op, value);
 }
 
-RegObj16& RegObj16::operator++()
+uint8_t RegComputedRead(ATtiny *chip, RegEnum reg)
 {
-	// split into read, modify, write
-	// So it is read low, read high, modify, write high, write low,
-	// to execute the operations in the documented order.
-	uint16_t v16=*this;
-	++v16;
-	*this=v16;
-	return *this;
+	return chip->GetValue(reg);
 }
 
-RegObj16& RegObj16::operator--()
+void RegChargeCycles(ATtiny *chip, uint32_t cycles)
 {
-	// split into read, modify, write
-	// So it is read low, read high, modify, write high, write low,
-	// to execute the operations in the documented order.
-	uint16_t v16=*this;
-	--v16;
-	*this=v16;
-	return *this;
+	chip->StopPoint();
+	chip->YieldPoint();
+	chip->Clock().Charge(cycles);
 }
 
-RegObj16::operator uint16_t()
+void RegTransactionBegin(ATtiny *chip)
 {
-	// read the low byte first as that stores the high byte in a temporary
-	uint16_t value=g_ATtiny.GetValue(Reg);
-	value |= (uint16_t)g_ATtiny.GetValue(RegH)<<8;
-	return value;
+	chip->BeginTransaction();
 }
 
-// Unlike compiling for the ATtiny where it only needs this function if
-// the compile time value is out of range and the function is needed,
-// it won't link here when it is undefined.
-uint8_t hz_is_not_valid(uint32_t hz)
+void RegTransactionEnd(ATtiny *chip)
 {
-	cerr << __func__ << " invalid " << hz << " value\n";
-	return CLKPR;
+	chip->EndTransaction();
 }
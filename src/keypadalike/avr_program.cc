@@ -20,35 +20,25 @@ hardware buttons and LEDs.
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#ifndef __LED_WIDGET_H
-#define __LED_WIDGET_H
+/* Linked into the program's shared object (see the Makefile), not the
+ * emulator, so every copy of the program loaded has its own context.
+ */
 
-#include <QWidget>
-#include <QTimer>
-#include <QTime>
+#include <avr/io.h>
+#include <iostream>
 
-class LEDWidget : public QWidget
+RegContext g_RegContext;
+
+RegContext *avr_context()
+{
+	return &g_RegContext;
+}
+
+// Unlike compiling for the ATtiny where it only needs this function if
+// the compile time value is out of range and the function is needed,
+// it won't link here when it is undefined.
+uint8_t hz_is_not_valid(uint32_t hz)
 {
-	Q_OBJECT
-public:
-	LEDWidget(QWidget *parent=NULL);
-	// There are three output color, high, low, or in between if it
-	// is frequently being turned on and off.
-	void SetOn(bool on);
-	bool GetOn() const { return On; }
-private slots:
-	void Timedout();
-protected:
-	void paintEvent(QPaintEvent *event);
-private:
-	// last requested state
-	bool On;
-	// displayed intensity, based on how often On changes
-	unsigned char Intensity;
-	// number of times requested to be on and off
-	int ReqOn, ReqOff;
-	QTimer Timer;
-	QTime Time;
-};
-
-#endif // __LED_WIDGET_H
+	std::cerr << __func__ << " invalid " << hz << " value\n";
+	return CLKPR;
+}
@@ -20,7 +20,7 @@ hardware buttons and LEDs.
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <util/delay.h>
+#include <avr/io.h>
 #include "ATtiny.h"
 #include <sys/time.h>
 #include <sched.h>
@@ -30,7 +30,7 @@ hardware buttons and LEDs.
 
 using namespace std;
 
-void _delay_ms(double ms)
+void RegDelay(ATtiny *chip, double ms)
 {
 	//printf("%s %10.6f seconds\n", __func__, ms/1000);
 	#if 0
@@ -55,36 +55,42 @@ void _delay_ms(double ms)
 		return;
 	}
 	#endif
-	int is_main=g_ATtiny.IsMain();
+	chip->StopPoint();
+	chip->YieldPoint();
+	// The delay is what the queued port writes were waiting for.
+	chip->FlushPorts();
+	// With virtual time the delay just moves the time forward, running
+	// the interrupts that would have gone off along the way.
+	VirtualClock &clock=chip->Clock();
+	if(clock.IsEnabled())
+	{
+		clock.Delay(ms/1000);
+		return;
+	}
+	int is_main=chip->IsMain();
+	// A handler keeps the baton through the delay like the hardware
+	// would, only main lets others run.
 	if(is_main)
-		g_ATtiny.MainStop();
-	/* Interrupts are already concurrent (other interrupts are allowed
-	 * to run) or not, so they don't need the inverse stop/start.
-	else
-		g_ATtiny.IntStop();
-		*/
+		chip->MainStop();
 	struct timespec req={(long int)(ms/1000)};
 	req.tv_nsec=(ms - req.tv_sec*1000)*1000000;
 	nanosleep(&req, NULL);
 	if(is_main)
-		g_ATtiny.MainStart();
-	/*
-	else
-		g_ATtiny.IntStart();
-	*/
-}
-
-void _delay_us(double us)
-{
-	_delay_ms(us/1000);
+		chip->MainStart();
 }
 
-void sei()
+void RegInterruptEnable(ATtiny *chip, bool enable)
 {
-	g_ATtiny.EnableInterrupts(true);
+	chip->EnableInterrupts(enable);
+	chip->Clock().Charge(1);
+	// run what was deferred while they were disabled
+	if(enable)
+		chip->Interrupts().Dispatch();
 }
 
-void cli()
+void RegSleep(ATtiny *chip)
 {
-	g_ATtiny.EnableInterrupts(false);
+	chip->Clock().Charge(1);
+	if(chip->GetValue(REG_MCUCR) & _BV(SE))
+		chip->MainSleep();
 }
@@ -0,0 +1,667 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Runs every program with every input scenario, each combination is a job,
+ * on a pool of worker threads, one per CPU by default.  Each worker runs
+ * its jobs one at a time with virtual time, and an idle worker steals jobs
+ * from the others.
+ *
+ * A scenario file has a line for each change of the buttons, the time in
+ * seconds of emulated time and the buttons pressed in hex (bit 0 to 9, see
+ * HallKeypad::SetButtons), and a line with the time and "end" where the
+ * job stops.  # starts a comment.
+ *	0.5 001
+ *	0.6 000
+ *	5 end
+ * A line can also save the chip to a file, or restore the chip from one,
+ * to start from a saved point instead of going through the same menus in
+ * every scenario, see ATtiny::SaveState for which programs can do that.
+ * The file is written by every job running the scenario.
+ *	4 save menu.state
+ *	1 restore menu.state
+ *
+ * The results are written in job order, a job line, a led line with the
+ * time and LEDs for each change, and a status line with how it ended
+ * (stopped at the end of the scenario, returned from main, or an error),
+ * the wall clock seconds, and the emulated seconds.
+ *
+ * usage: keypadalike-batch --program=path... [--scenario=path...]
+ *	[--seconds=S] [--jobs=N] [--output=path] [--fork-at=S [--timeout=S]]
+ * --seconds is the end for scenarios without one, and without any
+ * scenario each program runs for that long with no input.
+ * --fork-at runs each program once up to that emulated time, then forks
+ * it for each scenario, up to --jobs at a time, see ForkServer.  A child
+ * that runs longer than --timeout wall clock seconds is killed.
+ */
+
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include "HallKeypad.h"
+#include "ATtiny.h"
+#include "ButtonLog.h"
+#include "util.h"
+
+// include/avr/io.h uses a macro to rename main to avr_main
+#ifdef AVR_MAIN
+#undef main
+#endif
+
+/* Presses the buttons of a scenario at their time, saves and restores the
+ * chip, and stops at the end or when a save or restore fails.
+ */
+class ScenarioDriver : public TimerScheduler::Client
+{
+public:
+	ScenarioDriver(ATtiny *chip, HallKeypad *keypad,
+		const Scenario *scenario, std::string *error) :
+		Chip(chip), Keypad(keypad), Script(scenario), Error(error),
+		Index(0)
+	{
+	}
+	void Start() { ScheduleNext(); }
+	virtual void Expire(uint32_t generation)
+	{
+		if(Index == Script->Steps.size())
+		{
+			Chip->Stop();
+			return;
+		}
+		const Scenario::Step &step=Script->Steps[Index++];
+		switch(step.Action)
+		{
+		case Scenario::Step::Press:
+			Keypad->SetButtons(step.Buttons);
+			break;
+		case Scenario::Step::Save:
+			if(!Save(step.Path.c_str()))
+			{
+				Fail("save " + step.Path + " failed");
+				return;
+			}
+			break;
+		case Scenario::Step::Restore:
+			if(!Chip->RestoreState(step.State))
+			{
+				Fail("restore " + step.Path + " failed");
+				return;
+			}
+			break;
+		}
+		ScheduleNext();
+	}
+private:
+	void ScheduleNext()
+	{
+		// steps at or after the end are never reached
+		uint64_t next=Script->End;
+		if(Index < Script->Steps.size() &&
+			Script->Steps[Index].Cycles < next)
+			next=Script->Steps[Index].Cycles;
+		else
+			Index=Script->Steps.size();
+		Chip->Scheduler().Schedule(this, next, 0);
+	}
+	bool Save(const char *path)
+	{
+		std::vector<uint8_t> state;
+		if(!Chip->SaveState(&state))
+			return false;
+		FILE *file=fopen(path, "wb");
+		if(!file)
+		{
+			perror(path);
+			return false;
+		}
+		bool ok=fwrite(&state[0], 1, state.size(), file)==state.size();
+		if(fclose(file) || !ok)
+		{
+			perror(path);
+			return false;
+		}
+		return true;
+	}
+	void Fail(const std::string &error)
+	{
+		*Error=error;
+		Chip->Stop();
+	}
+	ATtiny *Chip;
+	HallKeypad *Keypad;
+	const Scenario *Script;
+	std::string *Error;
+	size_t Index;
+};
+
+struct Result
+{
+	struct LED
+	{
+		uint64_t Cycles;
+		uint16_t Value;
+	};
+	std::vector<LED> LEDs;
+	std::string Error;
+	bool Stopped;
+	int Return;
+	double Wall;
+	uint64_t Cycles;
+};
+
+// Records the LED changes with their time.
+class Recorder : public HallKeypad::Display
+{
+public:
+	Recorder(ATtiny *chip, Result *result) : Chip(chip), Out(result) {}
+	void SetResult(Result *result) { Out=result; }
+	virtual void ShowLEDs(uint16_t led)
+	{
+		Result::LED change={Chip->Clock().Now(), led};
+		Out->LEDs.push_back(change);
+	}
+private:
+	ATtiny *Chip;
+	Result *Out;
+};
+
+struct Job
+{
+	const char *Program;
+	const Scenario *Script;
+	Result Out;
+	// with --fork-at, the results as printed by the child
+	std::string Report;
+};
+
+static void RunJob(Job *job)
+{
+	Result &out=job->Out;
+	ATtiny chip;
+	HallKeypad keypad;
+	Recorder recorder(&chip, &out);
+	ScenarioDriver driver(&chip, &keypad, job->Script, &out.Error);
+	if(!chip.Load(job->Program))
+	{
+		out.Error="load failed";
+		return;
+	}
+	chip.EnableVirtualTime();
+	keypad.SetDisplay(&recorder);
+	chip.SetPeripheral(&keypad);
+	driver.Start();
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	out.Return=chip.Run();
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	out.Wall=now - start;
+	out.Stopped=chip.IsStopped();
+	out.Cycles=chip.Clock().Now();
+	// the timer thread can't call the driver or the keypad after this
+	chip.Scheduler().Stop();
+}
+
+/* Each worker has its own queue, it takes jobs from the front of its own
+ * and steals from the back of the others when it runs out.
+ */
+class Worker : public QThread
+{
+public:
+	Worker(int index, std::vector<Worker*> *all) :
+		Index(index), All(all) {}
+	// only before the workers start
+	void Add(Job *job) { Queue.push_back(job); }
+protected:
+	void run()
+	{
+		while(Job *job=Next())
+			RunJob(job);
+	}
+private:
+	Job* Take(bool front)
+	{
+		QMutexLocker locker(&Mutex);
+		if(Queue.empty())
+			return NULL;
+		Job *job;
+		if(front)
+		{
+			job=Queue.front();
+			Queue.pop_front();
+		}
+		else
+		{
+			job=Queue.back();
+			Queue.pop_back();
+		}
+		return job;
+	}
+	Job* Next()
+	{
+		if(Job *job=Take(true))
+			return job;
+		size_t count=All->size();
+		for(size_t i=1; i<count; ++i)
+		{
+			if(Job *job=(*All)[(Index+i)%count]->Take(false))
+				return job;
+		}
+		return NULL;
+	}
+	int Index;
+	std::vector<Worker*> *All;
+	QMutex Mutex;
+	std::deque<Job*> Queue;
+};
+
+static void PrintResult(FILE *file, const Job &job)
+{
+	const Result &out=job.Out;
+	fprintf(file, "job program %s scenario %s\n", job.Program,
+		job.Script->Path.c_str());
+	for(size_t i=0; i<out.LEDs.size(); ++i)
+		fprintf(file, "led %.6f %03x\n",
+			VirtualClock::ToSeconds(out.LEDs[i].Cycles),
+			out.LEDs[i].Value);
+	if(!out.Error.empty())
+		fprintf(file, "status error %s\n", out.Error.c_str());
+	else if(out.Stopped)
+		fprintf(file, "status stopped wall %.6f emulated %.6f\n",
+			out.Wall, VirtualClock::ToSeconds(out.Cycles));
+	else
+		fprintf(file, "status returned %d wall %.6f emulated %.6f\n",
+			out.Return, out.Wall,
+			VirtualClock::ToSeconds(out.Cycles));
+}
+
+/* With --fork-at each program runs once, with no input, until the fork
+ * time, then the process forks a child for each scenario that continues
+ * from there.  The children don't pay for loading the program or running
+ * its startup again, and only copy the memory they change.
+ *
+ * The fork is from this event on the program's main thread, run at its
+ * next call into the emulator if the event was on another thread (see
+ * ATtiny::RequestMainCall).  The other threads aren't in the child, the
+ * chip starts its own stall detector again.  The parent keeps up to Parallel children running, collects what
+ * each one prints through a pipe, and reaps them, killing any that run
+ * longer than the timeout.
+ */
+class ForkServer : public TimerScheduler::Client
+{
+public:
+	ForkServer(ATtiny *chip, HallKeypad *keypad, Recorder *recorder,
+		const Result *boot, const std::vector<Job*> &jobs,
+		int parallel, double timeout) :
+		Chip(chip), Keypad(keypad), Screen(recorder), Boot(boot),
+		Jobs(jobs), Parallel(parallel), Timeout(timeout), Forked(false),
+		ChildJob(NULL), ChildFd(-1)
+	{
+	}
+	virtual void Expire(uint32_t generation);
+	// The parent reached the fork time.
+	bool IsForked() const { return Forked; }
+	// In a child, its job and the pipe to print the results to.
+	Job* GetChildJob() const { return ChildJob; }
+	int GetChildFd() const { return ChildFd; }
+	struct timeval ChildStart;
+private:
+	struct Child
+	{
+		pid_t Pid;
+		int Fd;
+		Job *Work;
+		struct timeval Start;
+		bool Killed;
+	};
+	// Returns after forking in the child, false in the parent.
+	bool StartChild(Job *job, std::vector<Child> *running);
+	// Read from the children, reap the ones that are done.
+	void Collect(std::vector<Child> *running);
+	ATtiny *Chip;
+	HallKeypad *Keypad;
+	Recorder *Screen;
+	const Result *Boot;
+	std::vector<Job*> Jobs;
+	int Parallel;
+	double Timeout;
+	bool Forked;
+	Job *ChildJob;
+	int ChildFd;
+};
+
+void ForkServer::Expire(uint32_t generation)
+{
+	/* The stall detector runs the events while the program spins, a
+	 * child forked from it wouldn't have the main thread.  The main
+	 * thread forks the next time it calls into the emulator instead,
+	 * the program stops spinning once the interrupt it waits for runs.
+	 */
+	if(!Chip->OnMainThread())
+	{
+		Chip->RequestMainCall(this);
+		return;
+	}
+	if(Forked)
+		return;
+	Forked=true;
+	std::vector<Child> running;
+	size_t next=0;
+	while(next < Jobs.size() || !running.empty())
+	{
+		while(next < Jobs.size() && (int)running.size() < Parallel)
+		{
+			if(StartChild(Jobs[next++], &running))
+				return;
+		}
+		Collect(&running);
+	}
+	// done, the parent doesn't run the program any further
+	Chip->Stop();
+}
+
+bool ForkServer::StartChild(Job *job, std::vector<Child> *running)
+{
+	int fds[2];
+	if(pipe(fds))
+	{
+		perror("pipe");
+		job->Out.Error="pipe failed";
+		return false;
+	}
+	// nothing buffered is printed twice
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid=fork();
+	if(pid==-1)
+	{
+		perror("fork");
+		job->Out.Error="fork failed";
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	if(!pid)
+	{
+		close(fds[0]);
+		for(size_t i=0; i<running->size(); ++i)
+			close((*running)[i].Fd);
+		gettimeofday(&ChildStart, NULL);
+		Chip->AfterFork();
+		ChildJob=job;
+		ChildFd=fds[1];
+		// start from the LEDs shown so far
+		job->Out.LEDs=Boot->LEDs;
+		Screen->SetResult(&job->Out);
+		// steps before now run right away
+		ScenarioDriver *driver=new ScenarioDriver(Chip, Keypad,
+			job->Script, &job->Out.Error);
+		driver->Start();
+		return true;
+	}
+	close(fds[1]);
+	Child child={pid, fds[0], job, {0, 0}, false};
+	gettimeofday(&child.Start, NULL);
+	running->push_back(child);
+	return false;
+}
+
+void ForkServer::Collect(std::vector<Child> *running)
+{
+	std::vector<struct pollfd> fds(running->size());
+	for(size_t i=0; i<running->size(); ++i)
+	{
+		fds[i].fd=(*running)[i].Fd;
+		fds[i].events=POLLIN;
+		fds[i].revents=0;
+	}
+	poll(&fds[0], fds.size(), 10);
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	for(size_t i=running->size(); i-- > 0; )
+	{
+		Child &child=(*running)[i];
+		if(!child.Killed && now - child.Start > Timeout)
+		{
+			kill(child.Pid, SIGKILL);
+			child.Killed=true;
+		}
+		if(!fds[i].revents)
+			continue;
+		char buf[4096];
+		ssize_t len=read(child.Fd, buf, sizeof(buf));
+		if(len > 0)
+		{
+			child.Work->Report.append(buf, len);
+			continue;
+		}
+		if(len < 0 && errno==EINTR)
+			continue;
+		close(child.Fd);
+		int status;
+		waitpid(child.Pid, &status, 0);
+		Result &out=child.Work->Out;
+		if(child.Killed)
+			out.Error="timeout";
+		else if(WIFSIGNALED(status))
+			out.Error=std::string("killed by ") +
+				strsignal(WTERMSIG(status));
+		else if(!WIFEXITED(status) || WEXITSTATUS(status))
+			out.Error="child failed";
+		// a child that didn't finish didn't print a status line
+		if(!out.Error.empty())
+			child.Work->Report.clear();
+		running->erase(running->begin()+i);
+	}
+}
+
+/* Runs all the jobs of one program with a ForkServer, in this thread.
+ * Returns in each child as well, after printing its job's results.
+ */
+static void RunForkServer(const std::vector<Job*> &jobs, double fork_at,
+	int parallel, double timeout)
+{
+	const char *program=jobs[0]->Program;
+	Result boot;
+	ATtiny chip;
+	HallKeypad keypad;
+	Recorder recorder(&chip, &boot);
+	ForkServer server(&chip, &keypad, &recorder, &boot, jobs, parallel,
+		timeout);
+	if(!chip.Load(program))
+	{
+		for(size_t i=0; i<jobs.size(); ++i)
+			jobs[i]->Out.Error="load failed";
+		return;
+	}
+	chip.EnableVirtualTime();
+	keypad.SetDisplay(&recorder);
+	chip.SetPeripheral(&keypad);
+	chip.Scheduler().Schedule(&server, VirtualClock::FromSeconds(fork_at),
+		0);
+	int ret=chip.Run();
+
+	if(Job *job=server.GetChildJob())
+	{
+		Result &out=job->Out;
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		out.Return=ret;
+		out.Wall=now - server.ChildStart;
+		out.Stopped=chip.IsStopped();
+		out.Cycles=chip.Clock().Now();
+		FILE *file=fdopen(server.GetChildFd(), "w");
+		if(file)
+		{
+			PrintResult(file, *job);
+			fclose(file);
+		}
+		// the other threads and the chip are left as they are
+		_exit(file ? 0 : 1);
+	}
+	if(!server.IsForked())
+	{
+		for(size_t i=0; i<jobs.size(); ++i)
+			jobs[i]->Out.Error="program ended before --fork-at";
+	}
+	chip.Scheduler().Stop();
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<const char*> programs;
+	std::vector<const char*> scenario_paths;
+	double seconds=10;
+	int jobs=QThread::idealThreadCount();
+	const char *output=NULL;
+	double fork_at=-1;
+	double timeout=10;
+	for(int i=1; i<argc; ++i)
+	{
+		bool valid=true;
+		if(!strncmp(argv[i], "--program=", 10))
+			programs.push_back(argv[i]+10);
+		else if(!strncmp(argv[i], "--scenario=", 11))
+			scenario_paths.push_back(argv[i]+11);
+		else if(!strncmp(argv[i], "--seconds=", 10))
+			valid=(seconds=atof(argv[i]+10)) > 0;
+		else if(!strncmp(argv[i], "--jobs=", 7))
+			valid=(jobs=atoi(argv[i]+7)) > 0;
+		else if(!strncmp(argv[i], "--output=", 9))
+			output=argv[i]+9;
+		else if(!strncmp(argv[i], "--fork-at=", 10))
+			valid=(fork_at=atof(argv[i]+10)) >= 0;
+		else if(!strncmp(argv[i], "--timeout=", 10))
+			valid=(timeout=atof(argv[i]+10)) > 0;
+		else
+			valid=false;
+		if(!valid)
+		{
+			fprintf(stderr, "usage: %s --program=path... "
+				"[--scenario=path...] [--seconds=S] "
+				"[--jobs=N] [--output=path] [--fork-at=S "
+				"[--timeout=S]]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(programs.empty())
+	{
+		fprintf(stderr, "%s: no --program given\n", argv[0]);
+		return 1;
+	}
+	if(jobs < 1)
+		jobs=1;
+
+	std::vector<Scenario> scenarios(std::max<size_t>(1,
+		scenario_paths.size()));
+	if(scenario_paths.empty())
+	{
+		scenarios[0].Path="none";
+		scenarios[0].End=VirtualClock::FromSeconds(seconds);
+	}
+	for(size_t i=0; i<scenario_paths.size(); ++i)
+	{
+		if(!LoadScenario(scenario_paths[i], seconds, &scenarios[i]))
+			return 1;
+	}
+
+	std::vector<Job> all(programs.size()*scenarios.size());
+	for(size_t i=0; i<all.size(); ++i)
+	{
+		Job &job=all[i];
+		job.Program=programs[i/scenarios.size()];
+		job.Script=&scenarios[i%scenarios.size()];
+		job.Out.Stopped=false;
+		job.Out.Return=0;
+		job.Out.Wall=0;
+		job.Out.Cycles=0;
+	}
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	if(fork_at >= 0)
+	{
+		// one program at a time, forking needs this to be the only
+		// thread running a chip
+		for(size_t i=0; i<all.size(); i+=scenarios.size())
+		{
+			std::vector<Job*> group;
+			for(size_t j=0; j<scenarios.size(); ++j)
+				group.push_back(&all[i+j]);
+			RunForkServer(group, fork_at, jobs, timeout);
+		}
+	}
+	else
+	{
+		std::vector<Worker*> workers(jobs);
+		for(int i=0; i<jobs; ++i)
+			workers[i]=new Worker(i, &workers);
+		for(size_t i=0; i<all.size(); ++i)
+			workers[i%jobs]->Add(&all[i]);
+		for(int i=0; i<jobs; ++i)
+			workers[i]->start();
+		for(int i=0; i<jobs; ++i)
+		{
+			workers[i]->wait();
+			delete workers[i];
+		}
+	}
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	FILE *file=output ? fopen(output, "w") : stdout;
+	if(!file)
+	{
+		perror(output);
+		return 1;
+	}
+	int failed=0;
+	for(size_t i=0; i<all.size(); ++i)
+	{
+		const Job &job=all[i];
+		if(!job.Report.empty())
+			fputs(job.Report.c_str(), file);
+		else
+			PrintResult(file, job);
+		if(!job.Out.Error.empty() ||
+			job.Report.find("\nstatus error ")!=std::string::npos)
+			++failed;
+	}
+	if(file != stdout)
+		fclose(file);
+	fprintf(stderr, "%zu jobs on %d workers in %.3f s, %d failed\n",
+		all.size(), jobs, now - start, failed);
+	return failed ? 1 : 0;
+}
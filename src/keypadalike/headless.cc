@@ -0,0 +1,310 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Runs the emulator without the GUI or playing audio, only QtCore is
+ * needed, for batch and CI machines without a display.  The LED frames are
+ * printed as a line with the instance, the emulated time in seconds, and
+ * the LEDs in hex.
+ *
+ * --program=path loads the program from path, by default libavr_target.so
+ * next to the executable.
+ * --instances=N runs N independent keypads each with its own copy of the
+ * program.
+ * --seconds=S stops the programs at S seconds of emulated time and exits,
+ * otherwise it runs until the programs return.
+ * --quiet doesn't print the LED frames.
+ * --replay=path plays the button changes recorded by keypadalike
+ * --record=path, or a script of them, to every instance, see ButtonLog.
+ * A script's end is used for --seconds.
+ * --wav=path writes the speaker to a WAV file at --sample-rate=Hz, 48000
+ * by default, see SpeakerWav.
+ * --leds=path writes the LED frames to a file, a line with the emulated
+ * time in seconds and the LEDs in hex.
+ * With --wav or --leds the program is run with virtual time, as fast as
+ * the host can, and the files are the same every run, use --seconds and
+ * --replay for how long and what input.  With more than one instance the
+ * instance number is appended as path.N.
+ * --virtual-time, --missed, --irq-stats, --min-hold, and
+ * --no-tone-oscillator are the same as keypadalike.
+ * The button input latency is printed on exit like keypadalike, without
+ * the paint stages.
+ */
+
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "HallKeypad.h"
+#include "ATtiny.h"
+#include "ChipStats.h"
+#include "ButtonLog.h"
+#include "SpeakerWav.h"
+
+// include/avr/io.h uses a macro to rename main to avr_main
+#ifdef AVR_MAIN
+#undef main
+#endif
+
+// One emulated keypad, the thread runs the program.
+class Instance : public QThread, public HallKeypad::Display,
+	public TimerScheduler::Client
+{
+public:
+	Instance(int index, bool quiet, int sample_hz) :
+		Player(&Chip, &Keypad), Wav(&Chip.Scheduler(), sample_hz),
+		Index(index), Quiet(quiet), LEDFile(NULL), End(UINT64_MAX)
+	{
+		Keypad.SetDisplay(this);
+	}
+	virtual void ShowLEDs(uint16_t led)
+	{
+		uint64_t now=Chip.Scheduler().Now();
+		if(!Quiet)
+			printf("%d %.6f %03x\n", Index,
+				VirtualClock::ToSeconds(now), led);
+		QMutexLocker locker(&Mutex);
+		if(LEDFile && now < End)
+			fprintf(LEDFile, "%.6f %03x\n",
+				VirtualClock::ToSeconds(now), led);
+	}
+	/* Write the LED frames before end to path, false with a message if
+	 * it can't be created.
+	 */
+	bool OpenLEDs(const char *path, uint64_t end)
+	{
+		QMutexLocker locker(&Mutex);
+		End=end;
+		if(!(LEDFile=fopen(path, "w")))
+			perror(path);
+		return LEDFile;
+	}
+	// Stop the chip when the time reaches end.
+	void StopAt(uint64_t end)
+	{
+		Chip.Scheduler().Schedule(this, end, 0);
+	}
+	virtual void Expire(uint32_t generation)
+	{
+		Chip.Stop();
+	}
+	// a program that didn't stop is still running, later frames are
+	// dropped
+	void CloseLEDs()
+	{
+		QMutexLocker locker(&Mutex);
+		if(LEDFile)
+			fclose(LEDFile);
+		LEDFile=NULL;
+	}
+	ATtiny Chip;
+	HallKeypad Keypad;
+	ButtonPlayer Player;
+	SpeakerWav Wav;
+protected:
+	void run() { Chip.Run(); }
+private:
+	int Index;
+	bool Quiet;
+	QMutex Mutex;
+	FILE *LEDFile;
+	uint64_t End;
+};
+
+// path, with the instance appended when there is more than one
+static std::string InstancePath(const char *path, int index, int instances)
+{
+	std::string ret(path);
+	if(instances > 1)
+	{
+		char buf[16];
+		snprintf(buf, sizeof(buf), ".%d", index);
+		ret+=buf;
+	}
+	return ret;
+}
+
+// libavr_target.so in the executable's directory
+static std::string DefaultProgram()
+{
+	char path[4096];
+	ssize_t len=readlink("/proc/self/exe", path, sizeof(path)-1);
+	if(len <= 0)
+		return "libavr_target.so";
+	path[len]=0;
+	std::string dir(path);
+	return dir.substr(0, dir.rfind('/')+1)+"libavr_target.so";
+}
+
+int main(int argc, char **argv)
+{
+	std::string program=DefaultProgram();
+	int instances=1;
+	double seconds=0;
+	bool quiet=false;
+	bool virtual_time=false;
+	TimerScheduler::MissPolicy policy=TimerScheduler::CatchUp;
+	bool irq_stats=false;
+	double min_hold=0;
+	const char *replay=NULL;
+	bool tone_oscillator=true;
+	const char *wav=NULL;
+	const char *leds=NULL;
+	int sample_hz=SquareSynth::DefaultSampleHz;
+	for(int i=1; i<argc; ++i)
+	{
+		bool valid=true;
+		if(!strcmp(argv[i], "--virtual-time"))
+			virtual_time=true;
+		else if(!strcmp(argv[i], "--irq-stats"))
+			irq_stats=true;
+		else if(!strcmp(argv[i], "--quiet"))
+			quiet=true;
+		else if(!strcmp(argv[i], "--no-tone-oscillator"))
+			tone_oscillator=false;
+		else if(!strncmp(argv[i], "--missed=", 9))
+			valid=TimerScheduler::ParseMissPolicy(argv[i]+9,
+				&policy);
+		else if(!strncmp(argv[i], "--program=", 10))
+			program=argv[i]+10;
+		else if(!strncmp(argv[i], "--instances=", 12))
+			valid=(instances=atoi(argv[i]+12)) > 0;
+		else if(!strncmp(argv[i], "--seconds=", 10))
+			valid=(seconds=atof(argv[i]+10)) > 0;
+		else if(!strncmp(argv[i], "--min-hold=", 11))
+			valid=(min_hold=atof(argv[i]+11)) >= 0;
+		else if(!strncmp(argv[i], "--replay=", 9))
+			replay=argv[i]+9;
+		else if(!strncmp(argv[i], "--wav=", 6))
+			wav=argv[i]+6;
+		else if(!strncmp(argv[i], "--leds=", 7))
+			leds=argv[i]+7;
+		else if(!strncmp(argv[i], "--sample-rate=", 14))
+			valid=(sample_hz=atoi(argv[i]+14)) >= 8000 &&
+				sample_hz <= 192000;
+		else
+			valid=false;
+		if(!valid)
+		{
+			fprintf(stderr, "usage: %s [--program=path] "
+				"[--instances=N] [--seconds=S] [--quiet] "
+				"[--virtual-time] "
+				"[--missed=catch-up|coalesce|skip] "
+				"[--irq-stats] [--min-hold=ms] "
+				"[--replay=path] [--no-tone-oscillator] "
+				"[--wav=path] [--sample-rate=Hz] "
+				"[--leds=path]\n", argv[0]);
+			return 1;
+		}
+	}
+	// a render is the same every run
+	if(wav || leds)
+		virtual_time=true;
+
+	std::vector<Instance*> keypads(instances);
+	for(int i=0; i<instances; ++i)
+	{
+		Instance *k=keypads[i]=new Instance(i, quiet, sample_hz);
+		if(!k->Chip.Load(program.c_str()))
+			return 1;
+		if(virtual_time)
+			k->Chip.EnableVirtualTime();
+		k->Chip.Scheduler().SetMissPolicy(policy);
+		k->Chip.EnableToneOscillator(tone_oscillator);
+		k->Keypad.SetMinHold(VirtualClock::FromSeconds(min_hold/1000));
+		if(replay && !k->Player.Load(replay))
+			return 1;
+		// a script's end is the end of the run
+		if(!seconds && k->Player.GetEnd())
+			seconds=VirtualClock::ToSeconds(k->Player.GetEnd());
+		// the program can run past the end before it is noticed
+		uint64_t end=seconds ? VirtualClock::FromSeconds(seconds) :
+			UINT64_MAX;
+		if(wav)
+		{
+			std::string path=InstancePath(wav, i, instances);
+			if(!k->Wav.Open(path.c_str()))
+				return 1;
+			k->Wav.SetEnd(end);
+			k->Keypad.SetSpeaker(&k->Wav);
+		}
+		if(leds)
+		{
+			std::string path=InstancePath(leds, i, instances);
+			if(!k->OpenLEDs(path.c_str(), end))
+				return 1;
+		}
+		k->Chip.SetPeripheral(&k->Keypad);
+		if(replay)
+			k->Player.Start();
+		if(seconds)
+			k->StopAt(end);
+	}
+	for(int i=0; i<instances; ++i)
+		keypads[i]->start();
+
+	// wait for every chip to stop at the end or for its program to return
+	for(int i=0; i<instances; ++i)
+	{
+		Instance *k=keypads[i];
+		if(!seconds)
+		{
+			k->wait();
+			continue;
+		}
+		/* The program stops the next time it calls into the emulator,
+		 * one spinning without doing so never does, its timers are
+		 * stopped instead so nothing more happens.
+		 */
+		while(!k->wait(100))
+		{
+			if(k->Chip.IsStopped())
+			{
+				k->Chip.Scheduler().Stop();
+				k->wait(1000);
+				break;
+			}
+		}
+	}
+	for(int i=0; i<instances; ++i)
+	{
+		keypads[i]->Wav.Close();
+		keypads[i]->CloseLEDs();
+	}
+	for(int i=0; i<instances; ++i)
+	{
+		if(instances > 1)
+			printf("instance %d\n", i);
+		PrintMissed(keypads[i]->Chip);
+		if(irq_stats)
+			PrintInterruptStats(keypads[i]->Chip);
+		PrintInputStats(keypads[i]->Keypad);
+	}
+	fflush(stdout);
+	// A program spinning past the end is still running, exit without
+	// waiting for it.
+	_exit(0);
+}
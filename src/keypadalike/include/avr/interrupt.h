@@ -23,13 +23,15 @@ hardware buttons and LEDs.
 #ifndef _INTERRUPT_H
 #define _INTERRUPT_H
 
+#include <avr/io.h>
+
 /* enable interrupts */
-void sei();
+inline void sei() { RegInterruptEnable(g_RegContext.Chip, true); }
 /* disable interrupts */
-void cli();
+inline void cli() { RegInterruptEnable(g_RegContext.Chip, false); }
 
 #define ISR(vector, ...) \
-extern "C" void vector() 
+AVR_EXPORT void vector() 
 	/* __attribute__ ((signal,__INTR_ATTRS)) __VA_ARGS__; */
 
 #endif // _INTERRUPT_H
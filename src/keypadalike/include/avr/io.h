@@ -24,6 +24,7 @@ hardware buttons and LEDs.
 #define _AVR_IO_H_
 
 #include <stdint.h>
+#include <atomic>
 
 #include "iotn2313.h"
 #include "common.h"
@@ -34,6 +35,12 @@ hardware buttons and LEDs.
 #define main avr_main
 #define AVR_MAIN
 #endif
+/* The program is compiled with -fvisibility=hidden so each loaded copy
+ * keeps its own state, the symbols the emulator looks up by name (main,
+ * the interrupt vectors, and avr_context) are exported with AVR_EXPORT.
+ */
+#define AVR_EXPORT extern "C" __attribute__((visibility("default")))
+AVR_EXPORT int avr_main();
 
 #define _BV(bit) (1 << (bit))
 
@@ -56,6 +63,8 @@ enum RegEnum
 
 	REG_MCUSR=0x34,
 	REG_WDTCSR=0x21,
+	// sleep enable and mode, see avr/sleep.h
+	REG_MCUCR=0x35,
 
 	// Timer 0
 	REG_TCCR0A=0x30,
@@ -94,120 +103,358 @@ enum RegEnum
 
 };
 
-// used to allow C++ operator operations to have both the register and value
-class RegValue
+// the operation a register object applies
+enum RegOp
 {
-public:
-	RegValue(RegEnum reg, uint8_t value) : Reg(reg), Value(value) {}
-	RegEnum Reg;
-	uint8_t Value;
+	REG_OP_ASSIGN,
+	REG_OP_ADD,
+	REG_OP_SUB,
+	REG_OP_OR,
+	REG_OP_AND,
+	REG_OP_XOR
+};
+
+inline uint8_t RegApply(RegOp op, uint8_t v, uint8_t value)
+{
+	switch(op)
+	{
+	case REG_OP_ASSIGN:
+		return value;
+	case REG_OP_ADD:
+		return v+value;
+	case REG_OP_SUB:
+		return v-value;
+	case REG_OP_OR:
+		return v|value;
+	case REG_OP_AND:
+		return v&value;
+	case REG_OP_XOR:
+		return v^value;
+	}
+	return v;
+}
+
+// System clock cycles charged to the virtual time for an in or out
+// instruction, and for an in, modify, out sequence.
+enum
+{
+	RegAccessCycles=1,
+	RegModifyCycles=3
+};
+
+class ATtiny;
+
+/* The emulator state used by the inline register operations, set up by
+ * the emulator.  File is the register values, Charge is set when the
+ * accesses are charged to the virtual time, and Chip is the emulated chip
+ * passed to the hooks.
+ *
+ * It is defined in avr_program.cc which is linked into the program's
+ * shared object.  It is hidden so each copy of the program loaded (see
+ * ATtiny::Load) uses its own, the emulator finds it with avr_context.
+ */
+struct RegContext
+{
+	std::atomic<uint8_t> *File;
+	bool Charge;
+	ATtiny *Chip;
+};
+extern RegContext g_RegContext __attribute__((visibility("hidden")));
+AVR_EXPORT RegContext *avr_context();
+
+/* Emulator hooks, each register write calls the hook for its peripheral
+ * directly, see RegKind.  They are defined in avr_io.cc.
+ */
+void RegPortWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value);
+void RegTimer0Write(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value);
+void RegTimer1Write(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value);
+// TIMSK and TIFR are shared by both timers
+void RegTimersWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value);
+void RegClockWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value);
+void RegSREGWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value);
+// registers that aren't emulated
+void RegOtherWrite(ATtiny *chip, RegEnum reg, RegOp op, uint8_t value);
+// registers with a value computed when read
+uint8_t RegComputedRead(ATtiny *chip, RegEnum reg);
+void RegChargeCycles(ATtiny *chip, uint32_t cycles);
+/* Port writes after begin are held and sent to the peripheral together
+ * when the matching end is reached, they nest.  Used by ATOMIC_BLOCK.
+ */
+void RegTransactionBegin(ATtiny *chip);
+void RegTransactionEnd(ATtiny *chip);
+/* The hooks for sei and cli, _delay_ms, and sleep_cpu, defined in
+ * avr_util.cc.
+ */
+void RegInterruptEnable(ATtiny *chip, bool enable);
+void RegDelay(ATtiny *chip, double ms);
+void RegSleep(ATtiny *chip);
+
+inline void RegCharge(uint32_t cycles)
+{
+	if(g_RegContext.Charge)
+		RegChargeCycles(g_RegContext.Chip, cycles);
+}
+
+// what handles writes to a register
+enum RegClass
+{
+	// only stores the value, accessed without a lock
+	REG_CLASS_STORAGE,
+	REG_CLASS_PORT,
+	REG_CLASS_TIMER0,
+	REG_CLASS_TIMER1,
+	REG_CLASS_TIMERS,
+	REG_CLASS_CLOCK,
+	REG_CLASS_SREG,
+	REG_CLASS_OTHER
+};
+
+/* Selects the handling for each register at compile time.  Write is the
+ * RegClass, ComputedRead is set if reading needs the emulator, otherwise
+ * the last value written is read directly.
+ */
+template<RegEnum R> struct RegKind
+{
+	static const RegClass Write=REG_CLASS_OTHER;
+	static const bool ComputedRead=false;
+};
+
+#define REG_KIND(reg, write, computed_read) \
+	template<> struct RegKind<reg> \
+	{ \
+		static const RegClass Write=write; \
+		static const bool ComputedRead=computed_read; \
+	};
+
+REG_KIND(REG_PINB, REG_CLASS_OTHER, true)
+REG_KIND(REG_DDRD, REG_CLASS_STORAGE, false)
+REG_KIND(REG_DDRB, REG_CLASS_STORAGE, false)
+REG_KIND(REG_DDRA, REG_CLASS_STORAGE, false)
+// the speaker pins can be kept by the ToneOscillator
+REG_KIND(REG_PORTD, REG_CLASS_PORT, true)
+REG_KIND(REG_PORTB, REG_CLASS_PORT, false)
+REG_KIND(REG_PORTA, REG_CLASS_PORT, false)
+REG_KIND(REG_CLKPR, REG_CLASS_CLOCK, false)
+REG_KIND(REG_MCUCR, REG_CLASS_STORAGE, false)
+REG_KIND(REG_TCCR0A, REG_CLASS_TIMER0, false)
+REG_KIND(REG_TCCR0B, REG_CLASS_TIMER0, false)
+REG_KIND(REG_TCNT0, REG_CLASS_TIMER0, true)
+REG_KIND(REG_OCR0A, REG_CLASS_TIMER0, false)
+REG_KIND(REG_OCR0B, REG_CLASS_TIMER0, false)
+REG_KIND(REG_TIMSK, REG_CLASS_TIMERS, false)
+REG_KIND(REG_TIFR, REG_CLASS_TIMERS, true)
+REG_KIND(REG_TCCR1A, REG_CLASS_TIMER1, false)
+REG_KIND(REG_TCCR1B, REG_CLASS_TIMER1, false)
+REG_KIND(REG_TCCR1C, REG_CLASS_TIMER1, false)
+REG_KIND(REG_TCNT1L, REG_CLASS_TIMER1, true)
+REG_KIND(REG_TCNT1H, REG_CLASS_TIMER1, true)
+REG_KIND(REG_OCR1AL, REG_CLASS_TIMER1, false)
+REG_KIND(REG_OCR1AH, REG_CLASS_TIMER1, false)
+REG_KIND(REG_OCR1BL, REG_CLASS_TIMER1, false)
+REG_KIND(REG_OCR1BH, REG_CLASS_TIMER1, false)
+REG_KIND(REG_ICR1L, REG_CLASS_TIMER1, false)
+REG_KIND(REG_ICR1H, REG_CLASS_TIMER1, false)
+REG_KIND(REG_SREG, REG_CLASS_SREG, false)
+
+#undef REG_KIND
+
+// Calls the hook for the RegClass, or for storage applies the operation
+// with an atomic operation.
+template<RegClass C> struct RegWriter;
+
+#define REG_WRITER(write, hook) \
+	template<> struct RegWriter<write> \
+	{ \
+		static void Write(RegEnum reg, RegOp op, uint8_t value) \
+		{ \
+			hook(g_RegContext.Chip, reg, op, value); \
+		} \
+	};
+
+REG_WRITER(REG_CLASS_PORT, RegPortWrite)
+REG_WRITER(REG_CLASS_TIMER0, RegTimer0Write)
+REG_WRITER(REG_CLASS_TIMER1, RegTimer1Write)
+REG_WRITER(REG_CLASS_TIMERS, RegTimersWrite)
+REG_WRITER(REG_CLASS_CLOCK, RegClockWrite)
+REG_WRITER(REG_CLASS_SREG, RegSREGWrite)
+REG_WRITER(REG_CLASS_OTHER, RegOtherWrite)
+
+#undef REG_WRITER
+
+template<> struct RegWriter<REG_CLASS_STORAGE>
+{
+	static void Write(RegEnum reg, RegOp op, uint8_t value)
+	{
+		std::atomic<uint8_t> &v=g_RegContext.File[reg];
+		switch(op)
+		{
+		case REG_OP_ASSIGN:
+			v=value;
+			break;
+		case REG_OP_ADD:
+			v+=value;
+			break;
+		case REG_OP_SUB:
+			v-=value;
+			break;
+		case REG_OP_OR:
+			v|=value;
+			break;
+		case REG_OP_AND:
+			v&=value;
+			break;
+		case REG_OP_XOR:
+			v^=value;
+			break;
+		}
+	}
 };
 
 /* The register object that gives source code compatibility for reading and
- * writing registers such as ports.
+ * writing registers such as ports.  It is a template on the register so
+ * each operation inlines to the handling for that register.
  */
+template<RegEnum R>
 class RegObj
 {
 public:
-	RegObj(RegEnum reg) : Reg(reg) {}
-	RegObj& operator=(uint8_t value);
-	RegObj& operator+=(uint8_t value);
-	RegObj& operator-=(uint8_t value);
-	RegObj& operator|=(uint8_t value);
-	RegObj& operator&=(uint8_t value);
-	RegObj& operator^=(uint8_t value);
-	RegObj& operator++();
-	RegObj& operator--();
+	RegObj& operator=(uint8_t value)
+	{
+		return Write(REG_OP_ASSIGN, value, RegAccessCycles);
+	}
+	RegObj& operator+=(uint8_t value)
+	{
+		return Write(REG_OP_ADD, value, RegModifyCycles);
+	}
+	RegObj& operator-=(uint8_t value)
+	{
+		return Write(REG_OP_SUB, value, RegModifyCycles);
+	}
+	RegObj& operator|=(uint8_t value)
+	{
+		return Write(REG_OP_OR, value, RegModifyCycles);
+	}
+	RegObj& operator&=(uint8_t value)
+	{
+		return Write(REG_OP_AND, value, RegModifyCycles);
+	}
+	RegObj& operator^=(uint8_t value)
+	{
+		return Write(REG_OP_XOR, value, RegModifyCycles);
+	}
+	RegObj& operator++() { return *this+=1; }
+	RegObj& operator--() { return *this-=1; }
 	// allow reading back as an integer
-	operator uint8_t();
+	operator uint8_t()
+	{
+		uint8_t value=RegKind<R>::ComputedRead ?
+			RegComputedRead(g_RegContext.Chip, R) :
+			(uint8_t)g_RegContext.File[R];
+		RegCharge(RegAccessCycles);
+		return value;
+	}
 private:
-	RegEnum Reg;
+	RegObj& Write(RegOp op, uint8_t value, uint32_t cycles)
+	{
+		RegWriter<RegKind<R>::Write>::Write(R, op, value);
+		RegCharge(cycles);
+		return *this;
+	}
 };
 
 /* SREG holds the interrupt enable, which means it has to deal with
- * concurrency, but that can't be handled in ATtinyChip, it must be done
- * in ATtiny, so it is treated specially.
+ * concurrency, RegSREGWrite leaves that to ATtiny.
  */
-class RegObj_SREG
-{
-public:
-	RegObj_SREG() : Reg(REG_SREG) {}
-	RegObj_SREG& operator=(uint8_t value);
-	RegObj_SREG& operator+=(uint8_t value);
-	RegObj_SREG& operator-=(uint8_t value);
-	RegObj_SREG& operator|=(uint8_t value);
-	RegObj_SREG& operator&=(uint8_t value);
-	RegObj_SREG& operator^=(uint8_t value);
-	RegObj_SREG& operator++();
-	RegObj_SREG& operator--();
-	// allow reading back as an integer
-	operator uint8_t();
-private:
-	RegEnum Reg;
-};
+typedef RegObj<REG_SREG> RegObj_SREG;
 
+/* From 16-bit Timer/Counter1 "Accessing 16-bit Registers"
+ * "To do a 16-bit write, the high byte must be written before the low byte.
+ * For a 16-bit read, the low byte must be read before the high byte."
+ * The read, modify, write operations are split to do them in that order.
+ */
+template<RegEnum R>
 class RegObj16
 {
 public:
-	RegObj16(RegEnum reg) : Reg(reg), RegH((RegEnum)(reg+1)) {}
-	RegObj16& operator=(uint16_t value);
-	RegObj16& operator+=(uint16_t value);
-	RegObj16& operator-=(uint16_t value);
-	RegObj16& operator|=(uint16_t value);
-	RegObj16& operator&=(uint16_t value);
-	RegObj16& operator^=(uint16_t value);
-	RegObj16& operator++();
-	RegObj16& operator--();
+	RegObj16& operator=(uint16_t value)
+	{
+		RegWriter<RegKind<RegH>::Write>::Write(RegH, REG_OP_ASSIGN,
+			value>>8);
+		RegWriter<RegKind<R>::Write>::Write(R, REG_OP_ASSIGN, value);
+		RegCharge(2*RegAccessCycles);
+		return *this;
+	}
+	RegObj16& operator+=(uint16_t value) { return *this=*this+value; }
+	RegObj16& operator-=(uint16_t value) { return *this=*this-value; }
+	RegObj16& operator|=(uint16_t value) { return *this=*this|value; }
+	RegObj16& operator&=(uint16_t value) { return *this=*this&value; }
+	RegObj16& operator^=(uint16_t value) { return *this=*this^value; }
+	RegObj16& operator++() { return *this+=1; }
+	RegObj16& operator--() { return *this-=1; }
 	// allow reading back as an integer
-	operator uint16_t();
+	operator uint16_t()
+	{
+		// read the low byte first as that stores the high byte in a
+		// temporary
+		uint16_t value=Read<R>();
+		value|=(uint16_t)Read<RegH>()<<8;
+		RegCharge(2*RegAccessCycles);
+		return value;
+	}
 private:
-	RegEnum Reg;
-	RegEnum RegH;
+	static const RegEnum RegH=(RegEnum)(R+1);
+	template<RegEnum Reg> static uint8_t Read()
+	{
+		return RegKind<Reg>::ComputedRead ?
+			RegComputedRead(g_RegContext.Chip, Reg) :
+			(uint8_t)g_RegContext.File[Reg];
+	}
 };
 
 // ATtiny
-extern RegObj PIND;
-extern RegObj DDRD;
-extern RegObj PORTD;
+extern RegObj<REG_PIND> PIND;
+extern RegObj<REG_DDRD> DDRD;
+extern RegObj<REG_PORTD> PORTD;
 
-extern RegObj PINB;
-extern RegObj DDRB;
-extern RegObj PORTB;
+extern RegObj<REG_PINB> PINB;
+extern RegObj<REG_DDRB> DDRB;
+extern RegObj<REG_PORTB> PORTB;
 
-extern RegObj PINA;
-extern RegObj DDRA;
-extern RegObj PORTA;
+extern RegObj<REG_PINA> PINA;
+extern RegObj<REG_DDRA> DDRA;
+extern RegObj<REG_PORTA> PORTA;
 
-extern RegObj CLKPR;
+extern RegObj<REG_CLKPR> CLKPR;
 
-extern RegObj MCUSR;
-extern RegObj WDTCSR;
+extern RegObj<REG_MCUSR> MCUSR;
+extern RegObj<REG_WDTCSR> WDTCSR;
+extern RegObj<REG_MCUCR> MCUCR;
 
 // Timer 0
-extern RegObj TCCR0A;
-extern RegObj TCCR0B;
-extern RegObj TCNT0;
-extern RegObj OCR0A;
-extern RegObj OCR0B;
-extern RegObj TIMSK;
-extern RegObj TIFR;
+extern RegObj<REG_TCCR0A> TCCR0A;
+extern RegObj<REG_TCCR0B> TCCR0B;
+extern RegObj<REG_TCNT0> TCNT0;
+extern RegObj<REG_OCR0A> OCR0A;
+extern RegObj<REG_OCR0B> OCR0B;
+extern RegObj<REG_TIMSK> TIMSK;
+extern RegObj<REG_TIFR> TIFR;
 
-// Timer 0
-extern RegObj TCCR1A;
-extern RegObj TCCR1B;
-extern RegObj TCCR1C;
-extern RegObj16 TCNT1;
-extern RegObj TCNT1L;
-extern RegObj TCNT1H;
-extern RegObj16 OCR1A;
-extern RegObj OCR1AL;
-extern RegObj OCR1AH;
-extern RegObj16 OCR1B;
-extern RegObj OCR1BL;
-extern RegObj OCR1BH;
-extern RegObj16 ICR1;
-extern RegObj ICR1L;
-extern RegObj ICR1H;
+// Timer 1
+extern RegObj<REG_TCCR1A> TCCR1A;
+extern RegObj<REG_TCCR1B> TCCR1B;
+extern RegObj<REG_TCCR1C> TCCR1C;
+extern RegObj16<REG_TCNT1> TCNT1;
+extern RegObj<REG_TCNT1L> TCNT1L;
+extern RegObj<REG_TCNT1H> TCNT1H;
+extern RegObj16<REG_OCR1A> OCR1A;
+extern RegObj<REG_OCR1AL> OCR1AL;
+extern RegObj<REG_OCR1AH> OCR1AH;
+extern RegObj16<REG_OCR1B> OCR1B;
+extern RegObj<REG_OCR1BL> OCR1BL;
+extern RegObj<REG_OCR1BH> OCR1BH;
+extern RegObj16<REG_ICR1> ICR1;
+extern RegObj<REG_ICR1L> ICR1L;
+extern RegObj<REG_ICR1H> ICR1H;
 
 extern RegObj_SREG SREG;
 
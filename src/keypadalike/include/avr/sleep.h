@@ -23,14 +23,33 @@ hardware buttons and LEDs.
 #ifndef _SLEEP_H
 #define _SLEEP_H
 
-#define SLEEP_MODE_IDLE         0
-#define SLEEP_MODE_PWR_DOWN     _BV(SM)
-
-inline void set_sleep_mode(int mode) {}
-inline void sleep_enable() {}
+#include <avr/io.h>
 
-inline void sleep_cpu() {}
-
-inline void sleep_disable() {}
+// MCUCR SM1 and SM0
+#define SLEEP_MODE_IDLE         0
+#define SLEEP_MODE_PWR_DOWN     _BV(SM0)
+#define SLEEP_MODE_STANDBY      _BV(SM1)
+
+inline void set_sleep_mode(uint8_t mode)
+{
+	MCUCR = (MCUCR & ~(_BV(SM1) | _BV(SM0))) | mode;
+}
+inline void sleep_enable() { MCUCR |= _BV(SE); }
+
+/* Sleeps until an interrupt handler runs if sleep is enabled.  Like the
+ * hardware "sei(); sleep_cpu();" won't miss an interrupt, a handler that
+ * ran after the sei wakes it right away.  Every mode is emulated as idle,
+ * the timers keep running.
+ */
+inline void sleep_cpu() { RegSleep(g_RegContext.Chip); }
+
+inline void sleep_disable() { MCUCR &= ~_BV(SE); }
+
+inline void sleep_mode()
+{
+	sleep_enable();
+	sleep_cpu();
+	sleep_disable();
+}
 
 #endif // _SLEEP_H
@@ -45,9 +45,13 @@ static __inline__ uint8_t __iSeiRetVal(void)
     return 1;
 }
 
+/* keypadalike, an ATOMIC_BLOCK is also a register transaction, the port
+ * writes in the block reach the keypad together when it exits.
+ */
 static __inline__ uint8_t __iCliRetVal(void)
 {
     cli();
+    RegTransactionBegin(g_RegContext.Chip);
     return 1;
 }
 
@@ -70,6 +74,19 @@ static __inline__ void __iRestore(const  uint8_t *__s)
     SREG = *__s;
     __asm__ volatile ("" ::: "memory");
 }
+
+/* ATOMIC_BLOCK exit, end the transaction before interrupts are enabled */
+static __inline__ void __iCommitSei(const uint8_t *__s)
+{
+    RegTransactionEnd(g_RegContext.Chip);
+    __iSeiParam(__s);
+}
+
+static __inline__ void __iCommitRestore(const  uint8_t *__s)
+{
+    RegTransactionEnd(g_RegContext.Chip);
+    __iRestore(__s);
+}
 #endif	/* !__DOXYGEN__ */
 
 /** \file */
@@ -242,7 +259,7 @@ main(void)
 #define ATOMIC_RESTORESTATE
 #else
 #define ATOMIC_RESTORESTATE uint8_t sreg_save \
-	__attribute__((__cleanup__(__iRestore))) = SREG
+	__attribute__((__cleanup__(__iCommitRestore))) = SREG
 #endif	/* __DOXYGEN__ */
 
 /** \def ATOMIC_FORCEON
@@ -263,7 +280,7 @@ main(void)
 #define ATOMIC_FORCEON
 #else
 #define ATOMIC_FORCEON uint8_t sreg_save \
-	__attribute__((__cleanup__(__iSeiParam))) = 0
+	__attribute__((__cleanup__(__iCommitSei))) = 0
 #endif	/* __DOXYGEN__ */
 
 /** \def NONATOMIC_RESTORESTATE
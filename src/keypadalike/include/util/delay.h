@@ -23,12 +23,15 @@ hardware buttons and LEDs.
 #ifndef _UTIL_DELAY_H
 #define _UTIL_DELAY_H
 
+#include <avr/io.h>
+
 /* In hardware the delay comes from a fixed number of instructions.  An
  * interrupt doesn't cause an early return, it doesn't here either.  It will
  * cause the delay to take that much more wall clock time, which isn't emulated
- * here.
+ * here.  With virtual time the delay moves the emulated clock forward instead
+ * of sleeping.
  */
-void _delay_ms(double ms);
-void _delay_us(double ms);
+inline void _delay_ms(double ms) { RegDelay(g_RegContext.Chip, ms); }
+inline void _delay_us(double us) { _delay_ms(us/1000); }
 
 #endif // _UTIL_DELAY_H
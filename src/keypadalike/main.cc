@@ -23,11 +23,18 @@ hardware buttons and LEDs.
 #include <QApplication>
 #include <QThread>
 #include <QMetaType>
+#include <vector>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include "MicroMain.h"
 #include "SoftIO.h"
 #include "HallKeypad.h"
+#include "KeypadLink.h"
+#include "SquareAudio.h"
 #include "ATtiny.h"
+#include "ChipStats.h"
+#include "ButtonLog.h"
 
 // include/avr/io.h uses a macro to rename main to avr_main
 #ifdef AVR_MAIN
@@ -40,32 +47,167 @@ hardware buttons and LEDs.
  * HallKeypad, accessed through ATtinyChip to read from write to SoftIO LED
  * and button status in place of the Hall Research KP2B keypad,
  * the object is given to ATtiny to call into (as the real microcontroller
- * would interface with)
+ * would interface with), KeypadLink connects it to SoftIO
+ * SquareAudio, the speaker
  * MicroMain runs the main microcontroller routine, interfaces with ATtiny
+ *
+ * See headless.cc for running without the GUI.
+ *
+ * --program=path loads the program from path, by default libavr_target.so
+ * next to the executable.
+ * --instances=N runs N independent keypads each with its own copy of the
+ * program and window.
+ * --virtual-time runs from an emulated cycle clock (see VirtualClock) instead
+ * of the wall clock, as fast as possible and the same every run.
+ * --missed selects what the wall clock timers do when they fall behind,
+ * see TimerScheduler::MissPolicy.
+ * --irq-stats prints the count, rate, latency, and coalesced count of each
+ * interrupt vector on exit, see InterruptController, the sleep_cpu wakeup
+ * latency, and the thread wakeups.
+ * --min-hold=ms shows each button change to the program for at least that
+ * long, see HallKeypad, otherwise until the program has read it.
+ * --record=path writes the button changes to path, see ButtonLog, with
+ * more than one instance the instance number is appended as path.N.
+ * --replay=path plays the button changes recorded in path to every
+ * instance, the buttons in the window still work.
+ * --sample-rate=Hz plays the speaker at that rate, 48000 by default, see
+ * SquareSynth.
+ * --no-tone-oscillator runs every interrupt handler playing a tone,
+ * instead of taking over once it only toggles the speaker, see
+ * ToneOscillator.
+ *
+ * On exit the button input latency is printed, with a histogram for each
+ * stage from the key press to the LED paint, see LatencyTrace.
  */
+// One emulated keypad.
+struct Instance
+{
+	ATtiny Chip;
+	HallKeypad Keypad;
+	KeypadLink Link;
+	SquareAudio Speaker;
+	SoftIO IO;
+	QThread Thread;
+	MicroMain Main;
+	ButtonRecorder Recorder;
+	ButtonPlayer Player;
+	Instance(int sample_hz) : Link(&Keypad, &Chip.Scheduler()),
+		Speaker(&Chip.Scheduler(), sample_hz), Main(&Chip), Recorder(&Chip),
+		Player(&Chip, &Keypad) {}
+};
+
 int main(int argc, char **argv)
 {
 	// Register the types to be used in indirect signals
 	qRegisterMetaType<uint16_t>("uint16_t");
 
 	QApplication app(argc, argv);
-	SoftIO io;
-	HallKeypad keypad;
-	QObject::connect(&io, SIGNAL(SetButtons(uint16_t)),
-		&keypad, SLOT(SetButtons(uint16_t)));
-	QObject::connect(&keypad, SIGNAL(SetLEDs(uint16_t)),
-		&io, SLOT(SetLEDs(uint16_t)));
-	io.show();
+	QString program=app.applicationDirPath()+"/libavr_target.so";
+	int instances=1;
+	bool virtual_time=false;
+	TimerScheduler::MissPolicy policy=TimerScheduler::CatchUp;
+	bool irq_stats=false;
+	double min_hold=0;
+	QString record, replay;
+	bool tone_oscillator=true;
+	int sample_hz=SquareSynth::DefaultSampleHz;
+	// QApplication removes the arguments it understands
+	for(int i=1; i<argc; ++i)
+	{
+		bool valid=true;
+		if(!strcmp(argv[i], "--virtual-time"))
+			virtual_time=true;
+		else if(!strcmp(argv[i], "--irq-stats"))
+			irq_stats=true;
+		else if(!strcmp(argv[i], "--no-tone-oscillator"))
+			tone_oscillator=false;
+		else if(!strncmp(argv[i], "--missed=", 9))
+			valid=TimerScheduler::ParseMissPolicy(argv[i]+9,
+				&policy);
+		else if(!strncmp(argv[i], "--program=", 10))
+			program=argv[i]+10;
+		else if(!strncmp(argv[i], "--instances=", 12))
+			valid=(instances=atoi(argv[i]+12)) > 0;
+		else if(!strncmp(argv[i], "--record=", 9))
+			record=argv[i]+9;
+		else if(!strncmp(argv[i], "--min-hold=", 11))
+			valid=(min_hold=atof(argv[i]+11)) >= 0;
+		else if(!strncmp(argv[i], "--replay=", 9))
+			replay=argv[i]+9;
+		else if(!strncmp(argv[i], "--sample-rate=", 14))
+			valid=(sample_hz=atoi(argv[i]+14)) >= 8000 &&
+				sample_hz <= 192000;
+		else
+			valid=false;
+		if(!valid)
+		{
+			fprintf(stderr, "usage: %s [--program=path] "
+				"[--instances=N] [--virtual-time] "
+				"[--missed=catch-up|coalesce|skip] "
+				"[--irq-stats] [--min-hold=ms] "
+				"[--record=path] [--replay=path] "
+				"[--sample-rate=Hz] [--no-tone-oscillator]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<Instance*> keypads(instances);
+	for(int i=0; i<instances; ++i)
+	{
+		Instance *k=keypads[i]=new Instance(sample_hz);
+		if(!k->Chip.Load(program.toLocal8Bit().constData()))
+			return 1;
+		if(virtual_time)
+			k->Chip.EnableVirtualTime();
+		k->Chip.Scheduler().SetMissPolicy(policy);
+		k->Chip.EnableToneOscillator(tone_oscillator);
+		k->Keypad.SetMinHold(VirtualClock::FromSeconds(min_hold/1000));
+		if(!record.isEmpty())
+		{
+			QString path=record;
+			if(instances > 1)
+				path+=QString(".%1").arg(i);
+			if(!k->Recorder.Open(path.toLocal8Bit().constData()))
+				return 1;
+			k->Link.SetRecorder(&k->Recorder);
+		}
+		if(!replay.isEmpty() &&
+			!k->Player.Load(replay.toLocal8Bit().constData()))
+			return 1;
+
+		QObject::connect(&k->IO, SIGNAL(SetButtons(uint16_t, quint64)),
+			&k->Link, SLOT(SetButtons(uint16_t, quint64)));
+		QObject::connect(&k->Link,
+			SIGNAL(SetLEDs(const LEDMailbox::Frame&)),
+			&k->IO, SLOT(SetLEDs(const LEDMailbox::Frame&)));
+		if(instances > 1)
+			k->IO.setWindowTitle(QString("keypadalike %1").arg(i));
+		k->IO.SetLatencyTrace(&k->Keypad.Latency());
+		k->IO.show();
 
-	QThread main_thread;
-	MicroMain micro_main;
-	micro_main.moveToThread(&main_thread);
-	QObject::connect(&main_thread, SIGNAL(started()),
-		&micro_main, SLOT(Run()));
-	main_thread.start();
+		// the keypad is attached and the replay scheduled before the
+		// program runs, see HallKeypad::Attach
+		k->Keypad.SetSpeaker(&k->Speaker);
+		k->Chip.SetPeripheral(&k->Keypad);
+		k->Player.Start();
 
-	g_ATtiny.SetPeripheral(&keypad);
+		k->Main.moveToThread(&k->Thread);
+		QObject::connect(&k->Thread, SIGNAL(started()),
+			&k->Main, SLOT(Run()));
+		k->Thread.start();
+	}
 	int ret = app.exec();
+	for(int i=0; i<instances; ++i)
+	{
+		keypads[i]->Recorder.Close();
+		if(instances > 1)
+			printf("instance %d\n", i);
+		PrintMissed(keypads[i]->Chip);
+		if(irq_stats)
+			PrintInterruptStats(keypads[i]->Chip);
+		PrintInputStats(keypads[i]->Keypad);
+	}
 	// The microprocessor main is not expected to return, just exit instead.
 	exit(2);
 	return ret;
@@ -0,0 +1,187 @@
+/*
+This program allows limited support to compile and run programs written for
+the Atmel ATTiny2313 to work like they were in a Hall Research KP2B keypad,
+only compiled for a native desktop environment with a Qt GUI instead of
+hardware buttons and LEDs.
+
+    Copyright (C) Copyright 2012 David Fries.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Register access microbenchmark, reports register operations per second.
+ * DDRB only stores a value and is accessed inline without the ATtiny
+ * lock, PORTA goes through the lock and ATtinyChip::SetPort (without a
+ * peripheral attached it has nothing else to do), which is about what
+ * every register access used to cost.  The register objects use the
+ * RegContext from avr_program.cc linked in.
+ *
+ * usage: regbench [seconds] [threads]
+ */
+
+#include <avr/io.h>
+#include <QThread>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <vector>
+#include "ATtiny.h"
+#include "util.h"
+
+// include/avr/io.h uses a macro to rename main to avr_main
+#ifdef AVR_MAIN
+#undef main
+#endif
+
+// The benchmark loop, returns after seconds with the operations done.
+typedef uint64_t (*BenchFunc)(double seconds);
+
+// checking the time every Batch operations
+const int Batch=1000;
+// keeps the reads from being optimized away
+static volatile uint8_t Sink;
+
+static double Elapsed(const struct timeval &start)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now - start;
+}
+
+static uint64_t StorageWrite(double seconds)
+{
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	uint64_t ops=0;
+	while(Elapsed(start) < seconds)
+	{
+		for(int i=0; i<Batch; ++i)
+			DDRB|=_BV(PB0);
+		ops+=Batch;
+	}
+	return ops;
+}
+
+static uint64_t StorageRead(double seconds)
+{
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	uint64_t ops=0;
+	uint8_t sum=0;
+	while(Elapsed(start) < seconds)
+	{
+		for(int i=0; i<Batch; ++i)
+			sum+=DDRB;
+		ops+=Batch;
+	}
+	Sink=sum;
+	return ops;
+}
+
+static uint64_t LockedWrite(double seconds)
+{
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	uint64_t ops=0;
+	while(Elapsed(start) < seconds)
+	{
+		for(int i=0; i<Batch; ++i)
+			PORTA^=_BV(PA0);
+		ops+=Batch;
+	}
+	return ops;
+}
+
+static uint64_t LockedRead(double seconds)
+{
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	uint64_t ops=0;
+	uint8_t sum=0;
+	while(Elapsed(start) < seconds)
+	{
+		for(int i=0; i<Batch; ++i)
+			sum+=TIFR;
+		ops+=Batch;
+	}
+	Sink=sum;
+	return ops;
+}
+
+class BenchThread : public QThread
+{
+public:
+	BenchThread(BenchFunc func, double seconds) :
+		Func(func), Seconds(seconds), Ops(0) {}
+	uint64_t GetOps() const { return Ops; }
+protected:
+	void run() { Ops=Func(Seconds); }
+private:
+	BenchFunc Func;
+	double Seconds;
+	uint64_t Ops;
+};
+
+static double Run(BenchFunc func, double seconds, int threads)
+{
+	std::vector<BenchThread*> bench(threads);
+	for(int i=0; i<threads; ++i)
+	{
+		bench[i]=new BenchThread(func, seconds);
+		bench[i]->start();
+	}
+	uint64_t ops=0;
+	for(int i=0; i<threads; ++i)
+	{
+		bench[i]->wait();
+		ops+=bench[i]->GetOps();
+		delete bench[i];
+	}
+	return ops/seconds;
+}
+
+int main(int argc, char **argv)
+{
+	double seconds=argc > 1 ? atof(argv[1]) : 1;
+	int threads=argc > 2 ? atoi(argv[2]) : 1;
+	if(seconds <= 0 || threads < 1)
+	{
+		fprintf(stderr, "usage: %s [seconds] [threads]\n", argv[0]);
+		return 1;
+	}
+	ATtiny chip;
+	chip.Attach(avr_context(), RTLD_DEFAULT, NULL);
+
+	struct
+	{
+		const char *name;
+		BenchFunc func;
+		double rate;
+	} bench[]={
+		{"DDRB |= (lock-free)", StorageWrite, 0},
+		{"PORTA ^= (locked)", LockedWrite, 0},
+		{"read DDRB (lock-free)", StorageRead, 0},
+		{"read TIFR (locked)", LockedRead, 0}};
+	const size_t count=sizeof(bench)/sizeof(*bench);
+	printf("%d thread(s), %g seconds each\n", threads, seconds);
+	for(size_t i=0; i<count; ++i)
+	{
+		bench[i].rate=Run(bench[i].func, seconds, threads);
+		printf("%-24s %12.0f ops/s\n", bench[i].name, bench[i].rate);
+	}
+	printf("write speedup %.1fx, read speedup %.1fx\n",
+		bench[0].rate/bench[1].rate, bench[2].rate/bench[3].rate);
+	return 0;
+}